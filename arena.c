@@ -0,0 +1,155 @@
+/*
+ * arena.c - bump allocated regions for per-request buffers
+ *
+ * Everything a request needs while it is being served (the rewritten
+ * request, the relay buffer, the copy kept for the cache, and in the
+ * blocking modes the rio buffer and header block too) is carved out of
+ * one arena by bumping an offset, and dropped all at once when the
+ * request is done. Arenas go back on a free list instead of to malloc,
+ * so serving a request doesn't touch the allocator, and the event loops
+ * only hold one while a request is in progress: a keep-alive connection
+ * waiting for its next request costs just its conn.
+ *
+ * The free list has no limit of its own, so a burst of connections
+ * doesn't turn into a malloc and free per request once it is over some
+ * size. Instead a thread wakes every ARENA_TRIM_SECS and frees the arenas
+ * that weren't needed since it last looked: those beyond the most that
+ * were in use at once in that time.
+ */
+#include "csapp.h"
+#include <stdint.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena{
+    arena *next;                // on the free list
+    size_t used;
+    char mem[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static sem_t arena_mutex;       // protects the free list and counts
+static arena *free_list;
+static int nfree, nused, nmade;
+static int peak;                // most in use at once since the last trim
+
+/* free the arenas the last ARENA_TRIM_SECS didn't need */
+static void *arena_trimmer(void *arg){
+    arena **link, *a, *list;
+    int keep, i;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+    while(1){
+        sleep(ARENA_TRIM_SECS);
+        P(&arena_mutex);
+        // the most recently used stay, they are likely still in cache
+        keep = peak - nused;
+        for(link = &free_list, i = 0; i < keep && *link != NULL; i++){
+            link = &(*link)->next;
+        }
+        list = *link;
+        *link = NULL;
+        nmade -= nfree - i;
+        nfree = i;
+        peak = nused;
+        V(&arena_mutex);
+        while((a = list) != NULL){
+            list = a->next;
+            free(a);
+        }
+    }
+    return NULL;
+}
+
+void arena_init(void){
+    pthread_t tid;
+
+    Sem_init(&arena_mutex, 0, 1);
+    Pthread_create(&tid, NULL, arena_trimmer, NULL);
+}
+
+arena *arena_get(void){
+    arena *a;
+
+    P(&arena_mutex);
+    if((a = free_list) != NULL){
+        free_list = a->next;
+        nfree--;
+    }
+    else{
+        nmade++;
+    }
+    if(++nused > peak){
+        peak = nused;
+    }
+    V(&arena_mutex);
+    if(a == NULL && (a = malloc(sizeof(arena) + ARENA_SIZE)) == NULL){
+        P(&arena_mutex);
+        nmade--;
+        nused--;
+        V(&arena_mutex);
+        return NULL;
+    }
+    a->used = 0;
+    return a;
+}
+
+void arena_put(arena *a){
+    P(&arena_mutex);
+    nused--;
+    a->next = free_list;
+    free_list = a;
+    nfree++;
+    V(&arena_mutex);
+}
+
+void *arena_alloc(arena *a, size_t n){
+    char *p;
+
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(n > ARENA_SIZE - a->used){
+        return NULL;
+    }
+    p = a->mem + a->used;
+    a->used += n;
+    return p;
+}
+
+void *arena_alloc_rest(arena *a, size_t *n){
+    char *p = a->mem + a->used;
+
+    *n = ARENA_SIZE - a->used;
+    a->used = ARENA_SIZE;
+    return p;
+}
+
+void arena_trim(arena *a, void *p, size_t n){
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->used = (char *)p - a->mem + n;
+}
+
+void arena_release(arena *a){
+    uintptr_t page = sysconf(_SC_PAGESIZE), start, end;
+
+    start = ((uintptr_t)(a->mem + a->used) + page - 1) & ~(page - 1);
+    end = (uintptr_t)(a->mem + ARENA_SIZE) & ~(page - 1);
+    if(start < end){
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+}
+
+size_t arena_used(arena *a){
+    return a->used;
+}
+
+void arena_reset(arena *a, size_t used){
+    a->used = used;
+}
+
+void arena_report(FILE *fp){
+    P(&arena_mutex);
+    fprintf(fp, "arenas: %d in use, %d free, %d allocated (%d KB each)\n",
+            nused, nfree, nmade, ARENA_SIZE / 1024);
+    V(&arena_mutex);
+}
@@ -0,0 +1,38 @@
+/*
+ * arena.h - bump allocated regions for per-request buffers
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#define ARENA_SIZE (128 * 1024) // a request's buffers and response copy
+#define ARENA_TRIM_SECS 10      // how often free arenas beyond the peak
+                                // use since the last time are freed
+
+typedef struct arena arena;
+
+/* set up the free list and start the thread that trims it */
+void arena_init(void);
+/* an empty arena, off the free list if there is one; NULL if out of
+ * memory
+ */
+arena *arena_get(void);
+/* give a back for reuse; everything carved from it goes with it */
+void arena_put(arena *a);
+/* carve n bytes out of a, aligned for any type; NULL if they don't fit */
+void *arena_alloc(arena *a, size_t n);
+/* carve out all that is left of a, setting *n to its size */
+void *arena_alloc_rest(arena *a, size_t *n);
+/* keep only the first n bytes of p, the last thing carved out of a */
+void arena_trim(arena *a, void *p, size_t n);
+/* give the pages of a past what is carved out back to the kernel, for
+ * an arena that will sit idle for a while; they are zeroed when used
+ * again
+ */
+void arena_release(arena *a);
+/* how much of a has been carved out, to go back to with arena_reset */
+size_t arena_used(arena *a);
+void arena_reset(arena *a, size_t used);
+/* print how many arenas there are */
+void arena_report(FILE *fp);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,110 @@
+/*
+ * header_bench.c - request header blocks parsed per second
+ *
+ * Parses requests as current browsers send them, with their long
+ * User-Agent, Accept, client hint and Cookie fields, through
+ * http_req_parse. make bench links it three times, against scan.c with
+ * the AVX2, SSE2 and plain C kernels, so running header_bench_scalar,
+ * header_bench_sse2 and header_bench_avx2 shows what the vector kernels
+ * gain.
+ *
+ * usage: bench/header_bench_<kernel> [rounds]
+ */
+#include "csapp.h"
+#include "http.h"
+#include "scan.h"
+
+static const char *requests[] = {
+    // Chrome on Windows, a page
+    "GET http://www.example.com/news/2024/index.html?ref=home HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\","
+    " \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64)"
+    " AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0"
+    " Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1700000000;"
+    " session=3f9a8b7c6d5e4f3a2b1c0d9e8f7a6b5c; consent=yes;"
+    " prefs=lang%3Den%26theme%3Ddark\r\n"
+    "\r\n",
+    // Firefox on Linux, an image
+    "GET http://static.example.org/img/banner-1200x400.webp HTTP/1.1\r\n"
+    "Host: static.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101"
+    " Firefox/125.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Referer: http://www.example.org/blog/post-42\r\n"
+    "Cookie: uid=7d2c9e41; visited=1\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-site\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n",
+    // Safari on macOS, a script
+    "GET http://cdn.example.net/js/app.3f9a8b7c.min.js HTTP/1.1\r\n"
+    "Host: cdn.example.net\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: cross-site\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7)"
+    " AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4.1"
+    " Safari/605.1.15\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "\r\n",
+};
+
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+int main(int argc, char **argv){
+    long rounds = argc > 1 ? atol(argv[1]) : 1000000, i, sink = 0;
+    size_t len[NREQUESTS], bytes = 0, j;
+    struct timespec a, b;
+    const char *kernel = scan_init();
+    double s;
+    http_req r;
+
+    for(j = 0; j < NREQUESTS; j++){
+        len[j] = strlen(requests[j]);
+        bytes += len[j];
+        if(http_req_parse(&r, requests[j], len[j]) != (int)len[j]){
+            fprintf(stderr, "request %zu doesn't parse\n", j);
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for(i = 0; i < rounds; i++){
+        for(j = 0; j < NREQUESTS; j++){
+            sink += http_req_parse(&r, requests[j], len[j]) + r.nfields;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    s = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+    printf("%-6s %10.0f req/s %8.1f MB/s\n", kernel,
+            rounds * NREQUESTS / s, rounds * bytes / s / 1e6);
+
+    // keep the loop from being optimized away
+    return sink == 42;
+}
@@ -0,0 +1,112 @@
+/*
+ * lookup_bench.c - cache hit latency as the cache fills
+ *
+ * Stores more and more small responses and, at each size, times random
+ * hits: cache_exist followed by cache_read_done, as serving one does.
+ * Next to it is the list the hash index replaced, walked with a lock
+ * taken and a strcmp done per entry, which grows with the entry count;
+ * the index only slows down as its entries outgrow the cpu caches.
+ *
+ * usage: bench/lookup_bench [largest entry count]
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "slab.h"
+
+#define LOOKUPS 1000000
+#define LIST_WORK 20000000      // entries walked per list size
+#define LIST_MAX 100000         // largest list walked
+#define BODY 64
+
+/* an entry of the list cache_exist used to walk */
+typedef struct entry entry;
+struct entry{
+    char *uri;
+    sem_t lock;
+    entry *next;
+};
+
+static entry *list_find(entry *e, char *uri){
+    int found;
+
+    for(; e != NULL; e = e->next){
+        P(&e->lock);
+        found = strcmp(e->uri, uri) == 0;
+        V(&e->lock);
+        if(found){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static double now_ns(void){
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int main(int argc, char **argv){
+    long max = argc > 1 ? atol(argv[1]) : 100000, n = 0, target, i;
+    long lookups;
+    char **uris, body[BODY];
+    unsigned r = 12345;
+    entry *list = NULL, *e;
+    cache_block *b;
+    double t, t_list;
+
+    // room for all of them, in one shard so nothing is split
+    slab_init(max * 1024);
+    cache_init(1, CACHE_POLICY_RECENCY, max * 1024, 0);
+    uris = (char **)Malloc(max * sizeof(char *));
+    memset(body, 'x', BODY);
+    // the cache says what it does on stdout
+    if(freopen("/dev/null", "w", stdout) == NULL){
+        unix_error("freopen error");
+    }
+    fprintf(stderr, "%10s %12s %12s\n", "entries", "index ns", "list ns");
+    for(target = 10; target <= max; target *= 10){
+        for(; n < target; n++){
+            uris[n] = (char *)Malloc(96);
+            snprintf(uris[n], 96,
+                    "http://origin.example.com:8080/static/obj/%ld.png", n);
+            if(!cache_store(uris[n], body, BODY, 1000)){
+                fprintf(stderr, "entry %ld didn't fit\n", n);
+                return 1;
+            }
+            if(n < LIST_MAX){
+                e = (entry *)Malloc(sizeof(entry));
+                e->uri = uris[n];
+                Sem_init(&e->lock, 0, 1);
+                e->next = list;
+                list = e;
+            }
+        }
+        t = now_ns();
+        for(i = 0; i < LOOKUPS; i++){
+            r = r * 1103515245 + 12345;
+            if((b = cache_exist(uris[(r >> 8) % n])) == NULL){
+                fprintf(stderr, "lost %s\n", uris[(r >> 8) % n]);
+                return 1;
+            }
+            cache_read_done(b);
+        }
+        t = (now_ns() - t) / LOOKUPS;
+        if(n > LIST_MAX){
+            fprintf(stderr, "%10ld %12.0f %12s\n", n, t, "-");
+            continue;
+        }
+        lookups = LIST_WORK / n;
+        t_list = now_ns();
+        for(i = 0; i < lookups; i++){
+            r = r * 1103515245 + 12345;
+            if(list_find(list, uris[(r >> 8) % n]) == NULL){
+                return 1;
+            }
+        }
+        t_list = (now_ns() - t_list) / lookups;
+        fprintf(stderr, "%10ld %12.0f %12.0f\n", n, t, t_list);
+    }
+    return 0;
+}
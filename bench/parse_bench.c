@@ -0,0 +1,202 @@
+/*
+ * parse_bench.c - requests parsed and rewritten per second
+ *
+ * Times the one-pass parser (http_req_parse, then rewrite_request into
+ * an arena) against the line-at-a-time parser it replaced: each line
+ * copied out like rio_readlineb does, the request line tokenized, the
+ * URI parsed into fixed arrays, every header line run through strstr
+ * and the forwarded request grown with sprintf chains that copy it
+ * whole for each field.
+ *
+ * usage: bench/parse_bench [requests]
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "upstream.h"
+#include "scan.h"
+
+#define OLD_TOKENS 4
+#define OLD_TOKEN_LEN 100
+
+static const char *request =
+    "GET http://www.example.com:8080/images/logo.png?size=large&v=3 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101"
+    " Firefox/120.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Cookie: session=abcdef0123456789; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+/* the next line of buf from *pos into line, as rio_readlineb copies it */
+static int old_readline(const char *buf, size_t *pos, char *line){
+    size_t n = 0;
+
+    while(buf[*pos] != 0 && n < MAXLINE - 1){
+        if((line[n++] = buf[(*pos)++]) == '\n'){
+            break;
+        }
+    }
+    line[n] = 0;
+    return n;
+}
+
+static int old_tokenize(char *buf, char tokens[OLD_TOKENS][OLD_TOKEN_LEN]){
+    int i, cur = 0, w;
+
+    for(i = 0; i < OLD_TOKENS; i++){
+        if(buf[cur] == '\n' || buf[cur] == '\r'){
+            break;
+        }
+        while(buf[cur] == '\t' || buf[cur] == ' '){
+            cur++;
+        }
+        for(w = 0; buf[cur] != '\t' && buf[cur] != ' ' && buf[cur] != '\r'
+                && buf[cur] != '\n' && w < OLD_TOKEN_LEN - 1; w++){
+            tokens[i][w] = buf[cur++];
+        }
+        tokens[i][w] = 0;
+    }
+    return i;
+}
+
+static int old_parse_uri(char *uri, char *port, char *host, char *rest){
+    char *p;
+    int i = 0;
+
+    if((p = strstr(uri, "//")) == NULL){
+        return -1;
+    }
+    for(p += 2; *p != ':' && *p != '/' && *p != 0; ){
+        host[i++] = *p++;
+    }
+    host[i] = 0;
+    i = 0;
+    if(*p == ':'){
+        for(p++; *p >= '0' && *p <= '9'; ){
+            port[i++] = *p++;
+        }
+    }
+    port[i] = 0;
+    for(i = 0; *p != 0; ){
+        rest[i++] = *p++;
+    }
+    if(i == 0){
+        rest[i++] = '/';
+    }
+    rest[i] = 0;
+    return 0;
+}
+
+/* sprintf(dst, "%s%s", dst, s) as the old code did, without the copy
+ * overlapping itself
+ */
+static void old_append(char *dst, const char *s){
+    char tmp[MAXLINE];
+    size_t n = strlen(dst);
+
+    memcpy(tmp, dst, n);
+    memcpy(dst, tmp, n);
+    strcpy(dst + n, s);
+}
+
+static int old_rewrite(const char *req, char *forward_buf, char *host,
+        char *port, char *uri){
+    char line[MAXLINE], extra[MAXLINE], rest[200];
+    char tokens[OLD_TOKENS][OLD_TOKEN_LEN];
+    size_t pos = 0;
+    int num_line = 0, host_seen = 0;
+
+    while(old_readline(req, &pos, line) > 0){
+        if(num_line++ == 0){
+            if(old_tokenize(line, tokens) < 2
+                    || strcmp(tokens[0], "GET") != 0
+                    || old_parse_uri(tokens[1], port, host, rest) < 0){
+                return -1;
+            }
+            strcpy(uri, tokens[1]);
+            if(*port == 0){
+                strcpy(port, "80");
+            }
+            sprintf(forward_buf, "GET %s HTTP/1.1\r\n", rest);
+            sprintf(extra, "User-Agent: Mozilla/5.0\r\n");
+            old_append(extra, "Connection: close\r\n");
+            old_append(extra, "Proxy-Connection: close\r\n");
+        }
+        else if(strstr(line, "User-Agent:") != NULL
+                || strstr(line, "Connection:") != NULL
+                || strstr(line, "Proxy-Connection:") != NULL){
+            // replaced by ours
+        }
+        else if(strlen(line) == 2 && strstr(line, "\r\n") != NULL){
+            if(!host_seen){
+                old_append(forward_buf, "Host: ");
+                old_append(forward_buf, host);
+                old_append(forward_buf, "\r\n");
+            }
+            old_append(forward_buf, extra);
+            old_append(forward_buf, "\r\n");
+            return strlen(forward_buf);
+        }
+        else if(strstr(line, "Host:") != NULL){
+            host_seen = 1;
+            old_append(forward_buf, line);
+        }
+        else{
+            old_append(extra, line);
+        }
+    }
+    return -1;
+}
+
+static double seconds(struct timespec *a, struct timespec *b){
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv){
+    char forward[MAXLINE], host[MAXLINE], port[MAXLINE], uri[MAXLINE];
+    char *fb, *h, *p, *u;
+    long n = argc > 1 ? atol(argv[1]) : 1000000, i, sink = 0;
+    size_t len = strlen(request), base;
+    struct timespec a, b;
+    http_req r;
+    arena *ar;
+
+    arena_init();
+    upstream_init(UPSTREAM_DEFAULT_IDLE, UPSTREAM_DEFAULT_MAX_IDLE);
+    ar = arena_get();
+    base = arena_used(ar);
+    printf("%ld requests of %zu bytes (scan kernel %s)\n", n, len,
+            scan_init());
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for(i = 0; i < n; i++){
+        sink += old_rewrite(request, forward, host, port, uri);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    printf("line at a time      %10.0f req/s\n", n / seconds(&a, &b));
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for(i = 0; i < n; i++){
+        sink += http_req_parse(&r, request, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    printf("one pass, parse     %10.0f req/s\n", n / seconds(&a, &b));
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for(i = 0; i < n; i++){
+        http_req_parse(&r, request, len);
+        arena_reset(ar, base);
+        sink += rewrite_request(&r, request, ar, &fb, &h, &p, &u);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    printf("one pass, + rewrite %10.0f req/s\n", n / seconds(&a, &b));
+
+    // keep the loops from being optimized away
+    return sink == 42;
+}
@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# relay_bench.sh - time the proxy relaying large uncacheable files from
+#     tiny, copying them through user space (-Z) against splicing them
+#
+#     usage: bench/relay_bench.sh [MB per file] [fetches]
+#
+#     Each fetch is a file bigger than the cache takes, so the proxy only
+#     relays it. Reports wall time and the proxy's CPU time per mode.
+#
+
+SIZE_MB=${1:-64}
+FETCHES=${2:-20}
+HOME_DIR=`pwd`
+BENCH_DIR=`mktemp -d /tmp/relay_bench.XXXXXX`
+HZ=`getconf CLK_TCK`
+
+#
+# cpu_ticks - user plus system clock ticks used so far by process $1
+#
+function cpu_ticks {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+#
+# now_ms - wall clock in milliseconds
+#
+function now_ms {
+    echo $(( `date +%s%N` / 1000000 ))
+}
+
+#
+# run_mode - start the proxy with flags $2.. and fetch the file through it
+#     FETCHES times; label the result $1
+#
+function run_mode {
+    local label=$1
+    shift
+    proxy_port=`./free-port.sh`
+    ./proxy "$@" ${proxy_port} > /dev/null 2>&1 &
+    proxy_pid=$!
+    sleep 1
+
+    start=`now_ms`
+    ticks=`cpu_ticks ${proxy_pid}`
+    for i in `seq ${FETCHES}`
+    do
+        curl --silent --max-time 60 --proxy http://localhost:${proxy_port} \
+            --output /dev/null http://localhost:${tiny_port}/big.bin
+    done
+    ticks=$(( `cpu_ticks ${proxy_pid}` - ticks ))
+    ms=$(( `now_ms` - start ))
+
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+    printf "%-16s %6d ms wall  %6d ms proxy cpu  %7.1f MB/s\n" "${label}" \
+        ${ms} $(( ticks * 1000 / HZ )) \
+        `awk "BEGIN { print ${SIZE_MB} * ${FETCHES} * 1000 / ${ms} }"`
+}
+
+if [ ! -x ./proxy -o ! -x ./tiny/tiny ]
+then
+    echo "Error: build the proxy and tiny first (make)"
+    exit 1
+fi
+
+# tiny serves files out of its working directory
+dd if=/dev/urandom of=${BENCH_DIR}/big.bin bs=1M count=${SIZE_MB} 2> /dev/null
+tiny_port=`./free-port.sh`
+(cd ${BENCH_DIR}; exec ${HOME_DIR}/tiny/tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+sleep 1
+
+echo "${FETCHES} fetches of a ${SIZE_MB} MB file"
+run_mode "event, copy" -Z
+run_mode "event, splice"
+run_mode "thread, copy" -m thread -Z
+run_mode "thread, splice" -m thread
+
+kill ${tiny_pid}
+wait ${tiny_pid} 2> /dev/null
+rm -rf ${BENCH_DIR}
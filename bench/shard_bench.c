@@ -0,0 +1,78 @@
+/*
+ * shard_bench.c - cache stores per second as the shard count grows
+ *
+ * Threads store responses under URIs of their own, all missing, with the
+ * cache small enough that most stores evict, which is when a single lock
+ * made every store wait for the others. It is run with 1, 2, 4, 8 and 16
+ * shards, each in a process of its own since a cache is set up once.
+ * Stores should scale with the shards up to the number of cpus.
+ *
+ * usage: bench/shard_bench [threads] [seconds]
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "slab.h"
+
+#define BENCH_CACHE_SIZE (64 * 1024 * 1024)
+#define BENCH_BODY 1024
+#define BENCH_KEYS 20000        // URIs per thread, stored round and round
+
+static volatile int stop;
+static char body[BENCH_BODY];
+
+static void *store_thread(void *arg){
+    long id = (long)arg, stores = 0;
+    char uri[96];
+
+    while(!stop){
+        snprintf(uri, sizeof(uri), "http://origin%ld.example.com/obj/%ld",
+                id, stores % BENCH_KEYS);
+        cache_store(uri, body, BENCH_BODY, 1000);
+        stores++;
+    }
+    return (void *)stores;
+}
+
+/* run nthreads storing into a cache of nshards for secs; returns the
+ * stores per second
+ */
+static double run(int nshards, int nthreads, int secs){
+    pthread_t tid[nthreads];
+    void *stores;
+    long total = 0;
+    int i;
+
+    slab_init(BENCH_CACHE_SIZE);
+    cache_init(nshards, CACHE_POLICY_TINYLFU, BENCH_CACHE_SIZE, 0);
+    for(i = 0; i < nthreads; i++){
+        Pthread_create(&tid[i], NULL, store_thread, (void *)(long)i);
+    }
+    sleep(secs);
+    stop = 1;
+    for(i = 0; i < nthreads; i++){
+        Pthread_join(tid[i], &stores);
+        total += (long)stores;
+    }
+    return (double)total / secs;
+}
+
+int main(int argc, char **argv){
+    int nthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int secs = argc > 2 ? atoi(argv[2]) : 2, n, status;
+
+    memset(body, 'x', BENCH_BODY);
+    fprintf(stderr, "%d threads, %d s each\n%6s %14s\n", nthreads, secs,
+            "shards", "stores/s");
+    for(n = 1; n <= 16; n *= 2){
+        if(Fork() == 0){
+            // the cache says what it does on stdout
+            if(freopen("/dev/null", "w", stdout) == NULL){
+                unix_error("freopen error");
+            }
+            fprintf(stderr, "%6d %14.0f\n", n, run(n, nthreads, secs));
+            exit(0);
+        }
+        Wait(&status);
+    }
+    return 0;
+}
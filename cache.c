@@ -1,129 +1,778 @@
 #include "csapp.h"
 #include <pthread.h>
+#include <stdint.h>
 #include "cache.h"
+#include "slab.h"
+#include "disk.h"
 
-cache_block *cache_first_block;               //the header of the linked list
-static int cur_time = 1;                       //Not strictly IRU, so we do not protect on this variable
-sem_t global_write_sem;                        //Only allow one writer access the cache!
-static int cur_cache_size;
-
-cache_block *cache_block_init(){
-    cache_block *cache_entry = (cache_block*)malloc(sizeof(cache_block));
-    cache_entry->bytes = 0;
-    cache_entry->uri[0] = 0;
-    cache_entry->buf = NULL;
-    Sem_init(&(cache_entry->reader_sem), 0, 1);
-    Sem_init(&(cache_entry->reader_writer_sem), 0, 1);
-    cache_entry->reader_cnt = 0;
-    cache_entry->last_visit = 0;
-    cache_entry->next = NULL;
-    return cache_entry;
+#define INDEX_INIT 64                          // slots at first, doubled at half full
+#define QUEUE_NUM 3                             // queues a policy may keep per shard
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH 1024                       // counters per row, per shard,
+                                                // at least
+#define SKETCH_BYTES 1024                       // and one per this much budget
+#define SKETCH_MAX 15                           // counters saturate here
+#define SKETCH_SAMPLES 10                       // lookups between halvings,
+                                                // per counter of a row
+#define WINDOW_PERCENT 1                        // of a shard, admitted freely
+#define PROTECTED_PERCENT 80                    // of the main area
+
+/* Open addressing index from uri to block, probed linearly. A slot keeps
+ * the hash so most probes never touch the block; the uri is compared in
+ * full only on a hash match.
+ */
+typedef struct {
+    uint64_t hash;
+    cache_block *block;                         // NULL if the slot is free
+} index_slot;
+
+typedef struct index_table index_table;
+
+struct index_table{
+    size_t cap;
+    index_table *retired;                       // next table waiting to be freed
+    index_slot slots[];
+};
+
+typedef struct {
+    cache_block *head;                          // newest block
+    cache_block *tail;                          // oldest, looked at first by eviction
+    size_t bytes;
+} cache_queue;
+
+/* The cache is split by uri hash into shards that share nothing: each
+ * has its own index, queues, budget and lock, so stores of different
+ * uris don't queue behind each other.
+ *
+ * Lookups take no lock. Blocks never change once published and a hit
+ * holds a reference, so a writer may unlink a block while it is being
+ * sent; the last reference hands it back to be freed. A block or index
+ * table unlinked in one epoch is freed only once no lookup that started
+ * in that epoch is still running, because such a lookup may hold the
+ * pointer without a reference yet.
+ */
+typedef struct {
+    sem_t mutex;                                // writers only: the index,
+                                                // the queues, size, reclaiming
+    index_table *index;                         // read without the lock
+    size_t cnt;
+    cache_queue queue[QUEUE_NUM];               // the policy's, under mutex
+    unsigned char *sketch;                      // W-TinyLFU access frequencies,
+                                                // updated without the lock
+    size_t sketch_width;                        // counters per row, a power of 2
+    long samples;                               // lookups since the last halving
+    cache_block **heap;                         // GDSF: min-heap by priority
+    size_t heap_len, heap_cap;
+    double inflation;                           // GDSF: priority last evicted
+    size_t size;                                // bytes linked into the index
+    size_t budget;                              // its share of the cache size
+    size_t max_cnt;                             // and of its entries, 0 for
+                                                // no limit
+    unsigned long epoch;                        // changed under mutex
+    long readers[2];                            // lookups running, by epoch parity
+    cache_block *released;                      // unlinked blocks whose last
+                                                // reference is gone, any thread
+    cache_block *limbo[2];                      // unlinked in an epoch, by parity
+    index_table *old_index[2];
+    long lookups, hits;                         // by cache_exist, atomically
+    long saved_us;                              // fetch_us of every hit
+} cache_shard;
+
+/* An eviction policy orders a shard's blocks. Hits can't touch its
+ * structures, which belong to writers; they count themselves in the
+ * block, and access sees every lookup, hit or miss, without the lock.
+ * The rest is called with the shard mutex held.
+ */
+typedef struct {
+    const char *name;
+    void (*init)(cache_shard *s);
+    void (*access)(cache_shard *s, uint64_t hash);
+    void (*insert)(cache_shard *s, cache_block *b);     // a new block
+    void (*remove)(cache_shard *s, cache_block *b);     // unlinked
+    cache_block *(*victim)(cache_shard *s);             // next to evict
+} cache_policy;
+
+static cache_shard *shards;
+static int nshards;
+static const cache_policy *policy;
+
+/* 64-bit FNV-1a */
+uint64_t cache_hash(const char *uri){
+    uint64_t h = 14695981039346656037ULL;
+
+    for(; *uri; uri++){
+        h = (h ^ (unsigned char)*uri) * 1099511628211ULL;
+    }
+    return h;
 }
 
-void cache_init(){
-    Sem_init(&global_write_sem, 0, 1);
-    cache_first_block = cache_block_init();
-    cur_cache_size = 0;
+/* the index probes with the low bits of the hash, so pick by the high */
+static cache_shard *shard_of(uint64_t hash){
+    return &shards[(hash >> 32) % nshards];
 }
 
-cache_block *cache_exist(char *uri){
-    cur_time++;
-
-    cache_block *cur_block = cache_first_block;
-    while(cur_block != NULL){
-        cache_wait_read(cur_block);
-        // now perform reading        
-        if(strcmp(cur_block->uri, uri) == 0){
-            // found the block
-            cur_block->last_visit = cur_time;
-            printf("cache found! %s\n", cur_block->uri);
-            return cur_block;
-        }
-        
-        // not the block want
-        cache_read_done(cur_block);
-        cur_block = cur_block->next;
-    }
-    
-    printf("no cache\n");
-    return NULL;
+/* enter a lookup; the epoch is checked again once counted, so a writer
+ * that saw no readers of the old epoch never misses us
+ */
+static unsigned long epoch_enter(cache_shard *s){
+    unsigned long e;
+
+    for(;;){
+        e = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&s->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) == e){
+            return e;
+        }
+        __atomic_fetch_sub(&s->readers[e & 1], 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void epoch_exit(cache_shard *s, unsigned long e){
+    __atomic_fetch_sub(&s->readers[e & 1], 1, __ATOMIC_RELEASE);
+}
+
+static void cache_block_free(cache_block *cache_entry){
+    slab_free(cache_entry, sizeof(cache_block) + cache_entry->bytes
+            + strlen(cache_entry->uri) + 1);
 }
-void fill_cache_block(cache_block *cache_entry, char* uri, char *buf_store, int bytes_store){
-    // Now performing write on find_i
-    P(&(cache_entry->reader_writer_sem));
 
-    // if the buf is not NULL, free it
-    if(cache_entry->buf != NULL){
-        free(cache_entry->buf);
-        cur_cache_size -= cache_entry->bytes;
-        printf("evicting %s\n",cache_entry->uri);
+/* free what was unlinked last epoch if its lookups are all done, and
+ * move to the next epoch; caller holds s->mutex
+ */
+static void epoch_advance(cache_shard *s){
+    unsigned long e = s->epoch, old = (e + 1) & 1;
+    cache_block *b, *next;
+    index_table *t;
+
+    // blocks let go of by their last reader were unlinked by now
+    b = __atomic_exchange_n(&s->released, NULL, __ATOMIC_ACQUIRE);
+    for(; b != NULL; b = next){
+        next = b->retired;
+        b->retired = s->limbo[e & 1];
+        s->limbo[e & 1] = b;
     }
-    // set content of buf 
-    cache_entry->buf = buf_store;
 
-    // copy uri    
-    strcpy(cache_entry->uri, uri);
-    printf("saving %s\n",uri);
+    if(__atomic_load_n(&s->readers[old], __ATOMIC_SEQ_CST) != 0){
+        return;
+    }
+    for(b = s->limbo[old]; b != NULL; b = next){
+        next = b->retired;
+        cache_block_free(b);
+    }
+    s->limbo[old] = NULL;
+    while((t = s->old_index[old]) != NULL){
+        s->old_index[old] = t->retired;
+        free(t);
+    }
+    __atomic_store_n(&s->epoch, e + 1, __ATOMIC_SEQ_CST);
+}
 
-    // set number of bytes    
-    cache_entry->bytes = bytes_store;
-    cur_cache_size += bytes_store;
-    // update last visit
-    cache_entry->last_visit = cur_time;
+/* free what no lookup can reach anymore, as far as the lookups still
+ * running allow: one advance frees the last epoch's blocks, the next
+ * this one's; caller holds s->mutex
+ */
+static void shard_reclaim(cache_shard *s){
+    epoch_advance(s);
+    epoch_advance(s);
+}
+
+/* take a reference unless the last one is already gone */
+static int block_get(cache_block *b){
+    int n = __atomic_load_n(&b->refcnt, __ATOMIC_RELAXED);
+
+    while(n > 0){
+        if(__atomic_compare_exchange_n(&b->refcnt, &n, n + 1, 1,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* drop the index's reference to an unlinked block; caller holds s->mutex */
+static void block_put_locked(cache_shard *s, cache_block *b){
+    if(__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        b->retired = s->limbo[s->epoch & 1];
+        s->limbo[s->epoch & 1] = b;
+    }
+}
+
+static void slot_set(index_slot *slot, uint64_t hash, cache_block *b){
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->block, b, __ATOMIC_RELEASE);
+}
+
+/* the slot of uri, or the free slot where it would go; writers only */
+static size_t index_probe(index_table *t, uint64_t hash, const char *uri){
+    size_t mask = t->cap - 1, i = hash & mask;
+    cache_block *b;
+
+    while((b = t->slots[i].block) != NULL){
+        if(t->slots[i].hash == hash && strcmp(b->uri, uri) == 0){
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* the block kept for uri, or NULL; caller holds s->mutex */
+static cache_block *index_find(cache_shard *s, uint64_t hash, const char *uri){
+    index_table *t = s->index;
+
+    return t != NULL ? t->slots[index_probe(t, hash, uri)].block : NULL;
+}
 
-    V(&(cache_entry->reader_writer_sem));   
+static void index_add(cache_shard *s, cache_block *b){
+    index_table *t = s->index, *old = t;
+    size_t i, cap;
 
+    if(t == NULL || 2 * (s->cnt + 1) > t->cap){
+        // keep probes short: rehash into twice the slots, and publish
+        // the new table only once it is filled
+        cap = old ? 2 * old->cap : INDEX_INIT;
+        t = (index_table *)Calloc(1, sizeof(index_table)
+                + cap * sizeof(index_slot));
+        t->cap = cap;
+        for(i = 0; old != NULL && i < old->cap; i++){
+            if(old->slots[i].block != NULL){
+                t->slots[index_probe(t, old->slots[i].hash,
+                        old->slots[i].block->uri)] = old->slots[i];
+            }
+        }
+        __atomic_store_n(&s->index, t, __ATOMIC_RELEASE);
+        if(old != NULL){
+            old->retired = s->old_index[s->epoch & 1];
+            s->old_index[s->epoch & 1] = old;
+        }
+    }
+    i = index_probe(t, b->hash, b->uri);
+    if(t->slots[i].block == NULL){
+        s->cnt++;
+    }
+    slot_set(&t->slots[i], b->hash, b);
 }
-void cache_store(char* uri, char *buf_store, int bytes_store){
-    P(&global_write_sem);
 
-    cur_time++;
-    cache_block *cur_block = cache_first_block;
-    cache_block *found_block = cur_block;
+/* a lookup racing the shift may miss an entry being moved, never
+ * find a wrong one
+ */
+static void index_del(cache_shard *s, cache_block *b){
+    index_table *t = s->index;
+    size_t mask = t->cap - 1, i = index_probe(t, b->hash, b->uri), j, home;
 
-    printf("cur cache size:%d\n",cur_cache_size);
-    // Now I am the only writer
-    if(cur_cache_size < MAX_CACHE_SIZE){
-        // if current size is smaller than MAX_CACHE_SIZE, directly append at the last
-        while(cur_block->next != NULL){
-            cur_block = cur_block->next;
+    if(t->slots[i].block != b){
+        return;
+    }
+    // shift later entries of the run back so no probe stops short
+    for(j = (i + 1) & mask; t->slots[j].block != NULL; j = (j + 1) & mask){
+        home = t->slots[j].hash & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            slot_set(&t->slots[i], t->slots[j].hash, t->slots[j].block);
+            i = j;
         }
-        cur_block->next = cache_block_init();
-        found_block = cur_block->next;
+    }
+    __atomic_store_n(&t->slots[i].block, NULL, __ATOMIC_RELEASE);
+    s->cnt--;
+}
+
+/* queue b as the newest block of q */
+static void queue_add(cache_shard *s, int q, cache_block *b){
+    cache_queue *queue = &s->queue[q];
+
+    b->queue = q;
+    b->prev = NULL;
+    b->next = queue->head;
+    if(queue->head != NULL){
+        queue->head->prev = b;
+    }
+    else{
+        queue->tail = b;
+    }
+    queue->head = b;
+    queue->bytes += b->charge;
+}
+
+static void queue_del(cache_shard *s, cache_block *b){
+    cache_queue *queue = &s->queue[b->queue];
+
+    if(b->prev != NULL){
+        b->prev->next = b->next;
+    }
+    else{
+        queue->head = b->next;
+    }
+    if(b->next != NULL){
+        b->next->prev = b->prev;
     }
     else{
-        // if current size is bigger than MAX_CACHE_SIZE, evict one
-        int max_last = cur_time;
-        while(cur_block != NULL){
-            if(cur_block->last_visit <= max_last){
-                max_last = found_block->last_visit;
-                found_block = cur_block;
+        queue->tail = b->prev;
+    }
+    queue->bytes -= b->charge;
+}
+
+static void queue_move(cache_shard *s, int q, cache_block *b){
+    queue_del(s, b);
+    queue_add(s, q, b);
+}
+
+/* whether b was hit since eviction last asked */
+static int block_referenced(cache_block *b){
+    int hits = __atomic_load_n(&b->hits, __ATOMIC_RELAXED);
+
+    if(hits == b->seen){
+        return 0;
+    }
+    b->seen = hits;
+    return 1;
+}
+
+/* Recency: one queue, new blocks at the front. Eviction takes the back,
+ * sending blocks hit since they were last looked at to the front
+ * instead, once per block.
+ */
+static void recency_insert(cache_shard *s, cache_block *b){
+    queue_add(s, 0, b);
+}
+
+static cache_block *recency_victim(cache_shard *s){
+    size_t chances = s->cnt;
+    cache_block *b;
+
+    while((b = s->queue[0].tail) != NULL && chances-- > 0
+            && block_referenced(b)){
+        queue_move(s, 0, b);
+    }
+    return b;
+}
+
+/* W-TinyLFU: new blocks enter a small window queue. Blocks pushed out of
+ * it join the main area's probation queue as candidates, and each one
+ * is weighed against the block eviction would take from the back of
+ * probation: whichever has been looked up less often, by a count-min
+ * sketch of recent lookups, is evicted. A probation block hit again
+ * moves to the protected queue, whose overflow goes back to probation.
+ * The sketch is halved every SKETCH_SAMPLES lookups per counter so old
+ * popularity fades.
+ */
+enum { Q_WINDOW, Q_PROBATION, Q_PROTECTED };
+
+static size_t sketch_index(cache_shard *s, uint64_t hash, int row){
+    uint64_t h = (hash + row * 0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL;
+
+    return row * s->sketch_width + ((h >> 32) & (s->sketch_width - 1));
+}
+
+static int sketch_freq(cache_shard *s, uint64_t hash){
+    int row, c, min = SKETCH_MAX;
+
+    for(row = 0; row < SKETCH_ROWS; row++){
+        c = __atomic_load_n(&s->sketch[sketch_index(s, hash, row)],
+                __ATOMIC_RELAXED);
+        if(c < min){
+            min = c;
+        }
+    }
+    return min;
+}
+
+/* a counter for about every entry the shard could hold */
+static void tinylfu_init(cache_shard *s){
+    size_t entries = s->budget / SKETCH_BYTES;
+
+    if(s->max_cnt > 0 && s->max_cnt < entries){
+        entries = s->max_cnt;
+    }
+    for(s->sketch_width = SKETCH_WIDTH; s->sketch_width < entries;
+            s->sketch_width *= 2){
+    }
+    s->sketch = (unsigned char *)Calloc(SKETCH_ROWS * s->sketch_width, 1);
+}
+
+/* a racing increment may be lost, which the estimate can afford */
+static void tinylfu_access(cache_shard *s, uint64_t hash){
+    unsigned char *c, n;
+    int row;
+
+    for(row = 0; row < SKETCH_ROWS; row++){
+        c = &s->sketch[sketch_index(s, hash, row)];
+        if((n = __atomic_load_n(c, __ATOMIC_RELAXED)) < SKETCH_MAX){
+            __atomic_store_n(c, n + 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&s->samples, 1, __ATOMIC_RELAXED);
+}
+
+static void tinylfu_age(cache_shard *s){
+    size_t i;
+
+    if((size_t)__atomic_load_n(&s->samples, __ATOMIC_RELAXED)
+            < SKETCH_SAMPLES * s->sketch_width){
+        return;
+    }
+    for(i = 0; i < SKETCH_ROWS * s->sketch_width; i++){
+        __atomic_store_n(&s->sketch[i],
+                __atomic_load_n(&s->sketch[i], __ATOMIC_RELAXED) / 2,
+                __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&s->samples, 0, __ATOMIC_RELAXED);
+}
+
+static void tinylfu_insert(cache_shard *s, cache_block *b){
+    size_t window = s->budget / 100 * WINDOW_PERCENT;
+    size_t chances = s->cnt;
+    cache_block *c;
+
+    tinylfu_age(s);
+    queue_add(s, Q_WINDOW, b);
+    while(s->queue[Q_WINDOW].bytes > window){
+        c = s->queue[Q_WINDOW].tail;
+        if(c != b && chances-- > 0 && block_referenced(c)){
+            queue_move(s, Q_WINDOW, c);
+            continue;
+        }
+        c->candidate = 1;
+        queue_move(s, Q_PROBATION, c);
+    }
+}
+
+/* move a block hit in probation up, pushing protected's overflow down */
+static void tinylfu_protect(cache_shard *s, cache_block *b){
+    size_t protect = (s->budget - s->budget / 100 * WINDOW_PERCENT) / 100
+        * PROTECTED_PERCENT;
+    size_t chances = s->cnt;
+    cache_block *c;
+
+    queue_move(s, Q_PROTECTED, b);
+    while(s->queue[Q_PROTECTED].bytes > protect){
+        c = s->queue[Q_PROTECTED].tail;
+        if(c != b && chances-- > 0 && block_referenced(c)){
+            queue_move(s, Q_PROTECTED, c);
+            continue;
+        }
+        queue_move(s, Q_PROBATION, c);
+    }
+}
+
+static cache_block *tinylfu_victim(cache_shard *s){
+    size_t chances = s->cnt;
+    cache_block *v, *c;
+
+    while((v = s->queue[Q_PROBATION].tail) != NULL){
+        if(v->candidate){
+            // nothing older to weigh it against
+            v->candidate = 0;
+        }
+        else if(chances-- > 0 && block_referenced(v)){
+            tinylfu_protect(s, v);
+            continue;
+        }
+        c = s->queue[Q_PROBATION].head;
+        if(c == v || !c->candidate){
+            return v;
+        }
+        c->candidate = 0;
+        return sketch_freq(s, c->hash) > sketch_freq(s, v->hash) ? v : c;
+    }
+    // probation is empty: whatever else is oldest
+    if((v = s->queue[Q_PROTECTED].tail) != NULL){
+        return v;
+    }
+    return s->queue[Q_WINDOW].tail;
+}
+
+/* GreedyDual-Size-Frequency: a block is worth (hits + 1) * fetch time
+ * / size, plus the shard's inflation when it was last valued, and the
+ * least worth goes first; evicting it raises the inflation to its
+ * priority, so blocks that stop being hit age out. Hits don't reach
+ * the heap: a block is valued again when it comes up for eviction.
+ */
+static void heap_set(cache_shard *s, size_t i, cache_block *b){
+    s->heap[i] = b;
+    b->heap_pos = i;
+}
+
+static void heap_up(cache_shard *s, size_t i){
+    cache_block *b = s->heap[i];
+
+    while(i > 0 && s->heap[(i - 1) / 2]->priority > b->priority){
+        heap_set(s, i, s->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(s, i, b);
+}
+
+static void heap_down(cache_shard *s, size_t i){
+    cache_block *b = s->heap[i];
+    size_t c;
+
+    while((c = 2 * i + 1) < s->heap_len){
+        if(c + 1 < s->heap_len
+                && s->heap[c + 1]->priority < s->heap[c]->priority){
+            c++;
+        }
+        if(s->heap[c]->priority >= b->priority){
+            break;
+        }
+        heap_set(s, i, s->heap[c]);
+        i = c;
+    }
+    heap_set(s, i, b);
+}
+
+static void gdsf_value(cache_shard *s, cache_block *b){
+    // a fetch too quick to time still costs something
+    b->priority = s->inflation
+        + (double)(b->seen + 1) * (b->fetch_us + 1) / b->charge;
+}
+
+static void gdsf_insert(cache_shard *s, cache_block *b){
+    if(s->heap_len == s->heap_cap){
+        s->heap_cap = s->heap_cap ? 2 * s->heap_cap : INDEX_INIT;
+        s->heap = (cache_block **)Realloc(s->heap,
+                s->heap_cap * sizeof(cache_block *));
+    }
+    gdsf_value(s, b);
+    heap_set(s, s->heap_len++, b);
+    heap_up(s, b->heap_pos);
+}
+
+static void gdsf_remove(cache_shard *s, cache_block *b){
+    size_t i = b->heap_pos;
+
+    if(i != --s->heap_len){
+        heap_set(s, i, s->heap[s->heap_len]);
+        heap_up(s, i);
+        heap_down(s, s->heap[i]->heap_pos);
+    }
+}
+
+static cache_block *gdsf_victim(cache_shard *s){
+    size_t chances = s->cnt;
+    cache_block *b;
+
+    while(s->heap_len > 0){
+        b = s->heap[0];
+        if(chances-- > 0 && block_referenced(b)){
+            // hit since it was valued
+            gdsf_value(s, b);
+            heap_down(s, 0);
+            continue;
+        }
+        s->inflation = b->priority;
+        return b;
+    }
+    return NULL;
+}
+
+static void policy_nop_init(cache_shard *s){
+    (void)s;
+}
+
+static void policy_nop_access(cache_shard *s, uint64_t hash){
+    (void)s;
+    (void)hash;
+}
+
+static const cache_policy policies[] = {
+    [CACHE_POLICY_RECENCY] = {"recency", policy_nop_init, policy_nop_access,
+        recency_insert, queue_del, recency_victim},
+    [CACHE_POLICY_TINYLFU] = {"tinylfu", tinylfu_init, tinylfu_access,
+        tinylfu_insert, queue_del, tinylfu_victim},
+    [CACHE_POLICY_GDSF] = {"gdsf", policy_nop_init, policy_nop_access,
+        gdsf_insert, gdsf_remove, gdsf_victim},
+};
+
+/* one slab chunk holds the block, then the response, then the uri;
+ * NULL if it is too large or there is no memory
+ */
+cache_block *cache_block_init(char *uri, char *buf_store, size_t bytes_store){
+    size_t uri_len = strlen(uri) + 1;
+    size_t n = sizeof(cache_block) + bytes_store + uri_len;
+    cache_block *cache_entry = (cache_block *)slab_alloc(n);
+
+    if(cache_entry == NULL){
+        return NULL;
+    }
+    cache_entry->bytes = bytes_store;
+    cache_entry->charge = slab_charge(n);
+    cache_entry->buf = (char *)(cache_entry + 1);
+    memcpy(cache_entry->buf, buf_store, bytes_store);
+    cache_entry->uri = cache_entry->buf + bytes_store;
+    memcpy(cache_entry->uri, uri, uri_len);
+    cache_entry->hash = cache_hash(uri);
+    // the index's reference
+    cache_entry->refcnt = 1;
+    cache_entry->fetch_us = 0;
+    cache_entry->hits = 0;
+    cache_entry->seen = 0;
+    cache_entry->priority = 0;
+    cache_entry->heap_pos = 0;
+    cache_entry->queue = 0;
+    cache_entry->candidate = 0;
+    cache_entry->prev = NULL;
+    cache_entry->next = NULL;
+    cache_entry->retired = NULL;
+    return cache_entry;
+}
+
+void cache_init(int n, int p, size_t size, size_t max_entries){
+    int i;
+
+    policy = &policies[p];
+    nshards = n;
+    shards = (cache_shard *)Calloc(n, sizeof(cache_shard));
+    for(i = 0; i < n; i++){
+        Sem_init(&shards[i].mutex, 0, 1);
+        shards[i].budget = size / n;
+        // at least one entry, or a limit smaller than n would be none
+        shards[i].max_cnt = max_entries > 0 && max_entries < (size_t)n ? 1
+            : max_entries / n;
+        policy->init(&shards[i]);
+    }
+}
+
+cache_block *cache_exist(char *uri){
+    uint64_t hash = cache_hash(uri);
+    cache_shard *s = shard_of(hash);
+    unsigned long e = epoch_enter(s);
+    index_table *t = __atomic_load_n(&s->index, __ATOMIC_ACQUIRE);
+    cache_block *cur_block = NULL;
+    size_t mask, i;
+
+    policy->access(s, hash);
+    if(t != NULL){
+        mask = t->cap - 1;
+        for(i = hash & mask; (cur_block = __atomic_load_n(&t->slots[i].block,
+                        __ATOMIC_ACQUIRE)) != NULL; i = (i + 1) & mask){
+            // a block being unlinked has no references left to take
+            if(__atomic_load_n(&t->slots[i].hash, __ATOMIC_RELAXED) == hash
+                    && cur_block->hash == hash
+                    && strcmp(cur_block->uri, uri) == 0
+                    && block_get(cur_block)){
+                break;
             }
-            cur_block = cur_block->next;
         }
     }
-    fill_cache_block(found_block, uri, buf_store, bytes_store);
-    
-    V(&global_write_sem);
+    epoch_exit(s, e);
+
+    __atomic_fetch_add(&s->lookups, 1, __ATOMIC_RELAXED);
+    if(cur_block == NULL){
+        printf("no cache\n");
+        return NULL;
+    }
+    __atomic_fetch_add(&s->hits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->saved_us, cur_block->fetch_us, __ATOMIC_RELAXED);
+    // for eviction to find when it next comes by
+    __atomic_fetch_add(&cur_block->hits, 1, __ATOMIC_RELAXED);
+    printf("cache found! %s\n", cur_block->uri);
+    return cur_block;
+}
+
+/* take a block out of the index and the policy and drop the index's
+ * reference; caller holds s->mutex
+ */
+static void cache_unlink(cache_shard *s, cache_block *cache_entry){
+    printf("evicting %s\n",cache_entry->uri);
+    index_del(s, cache_entry);
+    policy->remove(s, cache_entry);
+    s->size -= cache_entry->charge;
+    block_put_locked(s, cache_entry);
 }
 
-void cache_wait_read(cache_block *cache_entry){
-    P(&(cache_entry->reader_sem));
-    if(cache_entry->reader_cnt == 0){
-        // currently no reader, wait for writer
-        P(&(cache_entry->reader_writer_sem));
+/* offer an evicted block to the disk tier, which keeps a reference to
+ * it until it is written; caller holds s->mutex, so the index's
+ * reference is still there
+ */
+static void cache_demote(cache_block *cache_entry){
+    __atomic_add_fetch(&cache_entry->refcnt, 1, __ATOMIC_RELAXED);
+    if(!disk_demote(cache_entry)){
+        __atomic_sub_fetch(&cache_entry->refcnt, 1, __ATOMIC_RELAXED);
     }
-    cache_entry->reader_cnt++;
-    V(&(cache_entry->reader_sem));    
+}
+
+int cache_store(char* uri, char *buf_store, size_t bytes_store, long fetch_us){
+    cache_block *cache_entry = cache_block_init(uri, buf_store, bytes_store);
+    cache_shard *s;
+    cache_block *victim;
+    int stored = 1;
+
+    if(cache_entry == NULL){
+        return 0;
+    }
+    s = shard_of(cache_entry->hash);
+    cache_entry->fetch_us = fetch_us;
+    if(cache_entry->charge > s->budget){
+        // more than the shard may hold
+        cache_block_free(cache_entry);
+        return 0;
+    }
+
+    P(&s->mutex);
+    printf("cur cache size:%zu\n",s->size);
+
+    // a block already kept for uri is replaced
+    if((victim = index_find(s, cache_entry->hash, uri)) != NULL){
+        cache_unlink(s, victim);
+    }
+    index_add(s, cache_entry);
+    policy->insert(s, cache_entry);
+    s->size += cache_entry->charge;
+    // evict until the shard is within budget, maybe the new block itself,
+    // and then it wasn't kept; what goes is offered to the disk tier
+    while((s->size > s->budget || (s->max_cnt > 0 && s->cnt > s->max_cnt))
+            && (victim = policy->victim(s)) != NULL){
+        if(victim == cache_entry){
+            stored = 0;
+        }
+        cache_demote(victim);
+        cache_unlink(s, victim);
+    }
+    shard_reclaim(s);
+    V(&s->mutex);
+    printf("saving %s\n",uri);
+    return stored;
 }
 
 void cache_read_done(cache_block *cache_entry){
-    P(&(cache_entry->reader_sem));
-    cache_entry->reader_cnt--;
-    if(cache_entry->reader_cnt == 0){
-        V(&(cache_entry->reader_writer_sem));
+    cache_shard *s;
+    cache_block *head;
+
+    if(__atomic_sub_fetch(&cache_entry->refcnt, 1, __ATOMIC_ACQ_REL) != 0){
+        return;
+    }
+    // it was unlinked while we sent it: free it now, unless a store
+    // holds the lock, and then that store or the next one does
+    s = shard_of(cache_entry->hash);
+    head = __atomic_load_n(&s->released, __ATOMIC_RELAXED);
+    do{
+        cache_entry->retired = head;
+    }while(!__atomic_compare_exchange_n(&s->released, &head, cache_entry, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if(sem_trywait(&s->mutex) == 0){
+        shard_reclaim(s);
+        V(&s->mutex);
     }
-    V(&(cache_entry->reader_sem));
 }
 
+void cache_report(FILE *fp){
+    size_t entries = 0, bytes = 0;
+    long lookups = 0, hits = 0, saved_us = 0;
+    int i;
+
+    for(i = 0; i < nshards; i++){
+        P(&shards[i].mutex);
+        entries += shards[i].cnt;
+        bytes += shards[i].size;
+        V(&shards[i].mutex);
+        lookups += __atomic_load_n(&shards[i].lookups, __ATOMIC_RELAXED);
+        hits += __atomic_load_n(&shards[i].hits, __ATOMIC_RELAXED);
+        saved_us += __atomic_load_n(&shards[i].saved_us, __ATOMIC_RELAXED);
+    }
+    fprintf(fp, "cache: %zu entries, %zu bytes in %d shards, %s eviction\n",
+            entries, bytes, nshards, policy->name);
+    fprintf(fp, "cache: %ld hits in %ld lookups (%.1f%%)\n", hits, lookups,
+            lookups > 0 ? 100.0 * hits / lookups : 0.0);
+    fprintf(fp, "cache: hits saved %.3f s of origin fetches\n",
+            saved_us / 1e6);
+}
 
@@ -1,28 +1,56 @@
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_BLOCK_NUM 21
-#define MAX_URI_LEN 256
+/* Recommended cache and object sizes, changed with -C and -O */
+#define CACHE_DEFAULT_SIZE 1049000
+#define CACHE_DEFAULT_MAX_OBJECT 102400
+#define CACHE_DEFAULT_SHARDS 4
+
+/* eviction policies, chosen with -p */
+#define CACHE_POLICY_RECENCY 0                  // second chance over one queue
+#define CACHE_POLICY_TINYLFU 1                  // W-TinyLFU
+#define CACHE_POLICY_GDSF 2                     // GreedyDual-Size-Frequency
 
 #ifndef STRUCT_CACHE_DEFINE
 #define STRUCT_CACHE_DEFINE
 typedef struct cache_block cache_block;
 
 struct cache_block{
-    int bytes;                                  // How many bytes of data in the block
-    char uri[MAX_URI_LEN];                      // the uri this block is caching
-    char *buf;                                  // the buffer it is pointing to
-    int reader_cnt;                             // number of reader
-    sem_t reader_sem;                           // sem to protect reader_cnt
-    sem_t reader_writer_sem;                    // sem to protect the whole block
-    int last_visit;                             // record last visit time
-    cache_block *next;                          // next block in the list
+    size_t bytes;                               // How many bytes of data in the block
+    size_t charge;                              // what its slab chunk costs
+                                                // the budget
+    char *uri;                                  // the uri this block is caching
+    uint64_t hash;                              // cache_hash(uri)
+    char *buf;                                  // the response, after the block
+    int refcnt;                                 // one for the index, one per hit
+                                                // still being sent
+    long fetch_us;                              // how long the origin took to send it
+    int hits;                                   // times found, counted without the lock
+    int seen;                                   // hits when eviction last looked
+    double priority;                            // GDSF: evicted lowest first
+    size_t heap_pos;                            // GDSF: where in the shard's heap
+    int queue;                                  // which of the shard's queues
+    int candidate;                              // new to the main area, not yet
+                                                // weighed against its victim
+    cache_block *prev;                          // nearer the front of the queue
+    cache_block *next;                          // nearer the back
+    cache_block *retired;                       // next block waiting to be freed
 };
 
 
 #endif
 
-void cache_init();
+/* split a cache of size bytes and at most max_entries entries (0 for
+ * no limit) into n shards, each with 1/n of both, evicting by policy
+ */
+void cache_init(int n, int policy, size_t size, size_t max_entries);
+/* the hash both cache tiers index uri by */
+uint64_t cache_hash(const char *uri);
 cache_block *cache_exist(char *uri);
-void cache_store(char* uri, char *buf_store, int bytes_store);
+/* keep a copy of a response the origin took fetch_us microseconds to
+ * send; returns 0 if there was no room for it or eviction chose it
+ */
+int cache_store(char* uri, char *buf_store, size_t bytes_store, long fetch_us);
+/* drop the reference cache_exist returned */
 void cache_read_done(cache_block *cache_entry);
-void cache_wait_read(cache_block *cache_entry);
+/* print how much is cached, how often lookups hit and the origin time
+ * the hits saved
+ */
+void cache_report(FILE *fp);
@@ -1017,33 +1017,83 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_getlineb - Return the next text line in the internal buffer
+ *    (buffered). *linep is pointed at the line, '\n' included, and
+ *    its length is returned; the line is not copied and stays valid
+ *    until the next read on rp. A line longer than maxlen (or than
+ *    the internal buffer) comes back in pieces. The buffer is only
+ *    compacted and refilled when a line crosses its end.
  */
-/* $begin rio_readlineb */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+/* $begin rio_getlineb */
+ssize_t rio_getlineb(rio_t *rp, char **linep, size_t maxlen) {
     size_t n;
-    int rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
+    ssize_t rc;
+    char *nl;
+
+    if (maxlen > RIO_BUFSIZE) {
+        maxlen = RIO_BUFSIZE;
+    }
+    while (1) {
+        n = (size_t) rp->rio_cnt < maxlen ? (size_t) rp->rio_cnt : maxlen;
+        if ((nl = memchr(rp->rio_bufptr, '\n', n)) != NULL) {
+            n = nl - rp->rio_bufptr + 1;
+            break;
+        }
+        if (n == maxlen) {
+            break;              /* No newline within maxlen */
+        }
+
+        /* The line runs past the buffered bytes: move them up front */
+        if (rp->rio_bufptr != rp->rio_buf) {
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                  RIO_BUFSIZE - rp->rio_cnt);
+        if (rc < 0) {
+            if (errno != EINTR) {
+                return -1;      /* errno set by read() */
             }
         } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break;    /* EOF, some data was read */
-            }
+            n = rp->rio_cnt;    /* EOF, last line has no newline */
+            break;
         } else {
-            return -1;    /* Error */
+            rp->rio_cnt += rc;
         }
     }
-    *bufp = 0;
-    return n-1;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+/* $end rio_getlineb */
+
+/*
+ * rio_readlineb - Robustly read a text line (buffered)
+ */
+/* $begin rio_readlineb */
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    size_t n = 0;
+    ssize_t rc;
+    char *line, *bufp = usrbuf;
+
+    /* Copy views of the line until its newline, EOF or maxlen-1 bytes */
+    while (n + 1 < maxlen) {
+        if ((rc = rio_getlineb(rp, &line, maxlen - 1 - n)) < 0) {
+            return -1;          /* Error */
+        } else if (rc == 0) {
+            break;              /* EOF */
+        }
+        memcpy(bufp + n, line, rc);
+        n += rc;
+        if (line[rc - 1] == '\n') {
+            break;
+        }
+    }
+    if (maxlen > 0) {
+        bufp[n] = 0;
+    }
+    return n;
 }
 /* $end rio_readlineb */
 
@@ -1078,6 +1128,15 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
     return rc;
 }
 
+ssize_t Rio_getlineb(rio_t *rp, char **linep, size_t maxlen) {
+    ssize_t rc;
+
+    if ((rc = rio_getlineb(rp, linep, maxlen)) < 0) {
+        unix_error("Rio_getlineb error");
+    }
+    return rc;
+}
+
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     ssize_t rc;
 
@@ -1102,7 +1161,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo hints, *listp;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -1115,6 +1174,25 @@ int open_clientfd(char *hostname, char *port) {
         return -2;
     }
 
+    clientfd = open_clientfd_list(listp);
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    return clientfd;
+}
+/* $end open_clientfd */
+
+/*
+ * open_clientfd_list - Connect to the first address in listp that takes
+ *     the connection, e.g. a list kept by a resolver cache. listp is
+ *     left alone.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_clientfd_list(struct addrinfo *listp) {
+    int clientfd = -1;
+    struct addrinfo *p;
+
     /* Walk the list for one that we can successfully connect to */
     for (p = listp; p; p = p->ai_next) {
         /* Create a socket descriptor */
@@ -1136,26 +1214,22 @@ int open_clientfd(char *hostname, char *port) {
         }
     }
 
-    /* Clean up */
-    freeaddrinfo(listp);
     if (!p) {   /* All connects failed */
         return -1;
     } else {      /* The last connect succeeded */
         return clientfd;
     }
 }
-/* $end open_clientfd */
 
 /*
- * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ * listenfd_open - Open and return a listening socket on port, optionally
+ *     with SO_REUSEPORT set so that several sockets can share the port.
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
-/* $begin open_listenfd */
-int open_listenfd(char *port) {
+static int listenfd_open(char *port, int reuseport) {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
 
@@ -1182,6 +1256,13 @@ int open_listenfd(char *port) {
         setsockopt(listenfd, SOL_SOCKET,    //line:netp:csapp:setsockopt
                 SO_REUSEADDR, (const void *) &optval , sizeof(int));
 
+        /* Let the kernel spread connections over every socket on port */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                    (const void *) &optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
             break; /* Success */
@@ -1207,8 +1288,29 @@ int open_listenfd(char *port) {
     }
     return listenfd;
 }
+
+/*
+ * open_listenfd - Open and return a listening socket on port. This
+ *     function is reentrant and protocol-independent.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ */
+/* $begin open_listenfd */
+int open_listenfd(char *port) {
+    return listenfd_open(port, 0);
+}
 /* $end open_listenfd */
 
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but the socket is one of
+ *     possibly many SO_REUSEPORT listeners on port.
+ */
+int open_reuseport_listenfd(char *port) {
+    return listenfd_open(port, 1);
+}
+
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
  ****************************************************/
@@ -1230,5 +1332,14 @@ int Open_listenfd(char *port) {
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port) {
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0) {
+        unix_error("Open_reuseport_listenfd error");
+    }
+    return rc;
+}
+
 /* $end csapp.c */
 
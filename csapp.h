@@ -6,6 +6,7 @@
 #define __CSAPP_H__
 
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE     /* for SO_REUSEPORT and friends */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -63,6 +64,7 @@ extern char **environ; /* Defined by libc */
 #define LISTENQ  1024  /* Second argument to listen() */
 
 /* Our own error-handling functions */
+#define gai_error csapp_gai_error  /* glibc has one under _GNU_SOURCE */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
@@ -180,6 +182,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_getlineb(rio_t *rp, char **linep, size_t maxlen);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -187,14 +190,18 @@ void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_getlineb(rio_t *rp, char **linep, size_t maxlen);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_list(struct addrinfo *listp);
 int open_listenfd(char *port);
+int open_reuseport_listenfd(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_reuseport_listenfd(char *port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
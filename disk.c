@@ -0,0 +1,623 @@
+/*
+ * disk.c - second cache tier in segment files on disk
+ *
+ * Responses evicted from memory, and those too large for it, are kept in
+ * a directory of segment files that are only ever appended to. Which
+ * response is where is known from an index in memory only; the segments
+ * of an earlier run are removed at startup.
+ *
+ * Everything written goes through a queue to a writer thread, so
+ * neither a store nor an event loop ever waits for the disk. Evicted
+ * blocks are appended to the newest segment until it is full; when more
+ * is queued than DISK_QUEUE_BYTES they are lost as before. A response
+ * too large for memory is queued piece by piece as it is relayed, and
+ * the writer puts it in a segment of its own that is indexed once it is
+ * complete; a piece that finds the queue full drops the response.
+ *
+ * The index keeps each response's header block in memory along with
+ * where it is, so a hit only reads the body, with sendfile or a read
+ * queued on an io_uring. When the segments hold more than the tier's
+ * size the oldest is removed, with everything in it; replaced responses
+ * stay in theirs until then. A hit holds its segment, so the file can
+ * still be read and the entry's header block used after it is removed;
+ * both go once the last hit is sent.
+ */
+#include "csapp.h"
+#include <stdint.h>
+#include "cache.h"
+#include "http.h"
+#include "disk.h"
+
+#define DISK_INDEX_INIT 1024    // buckets at first, doubled at one entry each
+
+typedef struct disk_entry disk_entry;
+
+struct disk_entry{
+    uint64_t hash;
+    disk_segment *seg;
+    off_t off;
+    size_t bytes;
+    size_t hdr_len;
+    char *hdr;                  // copy of the header block, after the uri
+    int live;                   // in the index, not replaced
+    disk_entry *chain;          // next in its bucket
+    disk_entry *seg_next;       // written to the segment before it
+    char uri[];
+};
+
+struct disk_segment{
+    unsigned long id;           // the file is seg.<id>
+    int fd;
+    size_t size;                // bytes written or being written to it
+    int refcnt;                 // the tier's while it is kept, one per
+                                // write or hit in progress
+    int dead;                   // removed, don't index what is written
+    disk_entry *entries;
+    disk_segment *next;         // the next newer segment
+};
+
+enum job_kind{
+    JOB_DEMOTE,                 // append an evicted block
+    JOB_SPILL,                  // write the next piece of a spill
+    JOB_FINISH                  // index a spill, or throw it away
+};
+
+typedef struct disk_job disk_job;
+
+struct disk_job{
+    int kind;
+    size_t bytes;               // counted against DISK_QUEUE_BYTES
+    cache_block *b;             // JOB_DEMOTE
+    disk_spill *sp;             // JOB_SPILL and JOB_FINISH
+    off_t off;                  // JOB_SPILL: where the piece goes
+    char *data;                 // JOB_SPILL: a copy of it, after the job
+    disk_job *next;
+};
+
+struct disk_spill{
+    disk_segment *seg;          // opened by the writer, not in the tier
+                                // until committed
+    size_t len;                 // bytes queued
+    size_t hdr_len;
+    char *hdr;                  // copy of the header block, for the index
+    int failed;                 // the writer couldn't write a piece
+    char *uri;                  // index it under this, NULL to drop it
+    void (*done)(void *arg, int ok);
+    void *arg;
+    disk_job finish;            // queued last, never dropped
+};
+
+static char *disk_dir;
+static size_t disk_budget;
+static size_t disk_max;         // largest response taken
+static size_t segment_max;      // bytes appended before starting another
+
+static sem_t disk_mutex;        // protects everything below
+static disk_entry **buckets;
+static size_t nbuckets, nentries;
+static disk_segment *oldest, *newest;
+static disk_segment *cur;       // the writer appends here, NULL for a new one
+static size_t disk_size;        // bytes in the tier's segments
+static int nsegments;
+static unsigned long next_id;
+static unsigned long hits, demoted;
+
+static disk_job *queue_head, *queue_tail;   // waiting for the writer
+static size_t queue_bytes;              // in them, and in the one running
+static unsigned long dropped;           // found the queue full
+static sem_t queue_mutex;               // protects the queue and dropped
+static sem_t queue_items;
+
+static void segment_path(char *path, unsigned long id){
+    snprintf(path, MAXLINE, "%s/seg.%lu", disk_dir, id);
+}
+
+/* a new empty segment file, held once; NULL if it can't be made. Caller
+ * holds disk_mutex.
+ */
+static disk_segment *segment_open(void){
+    char path[MAXLINE];
+    disk_segment *seg;
+    int fd;
+
+    segment_path(path, next_id);
+    if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0){
+        fprintf(stderr, "can not make disk segment %s: %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+    if((seg = (disk_segment *)calloc(1, sizeof(disk_segment))) == NULL){
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    seg->id = next_id++;
+    seg->fd = fd;
+    seg->refcnt = 1;
+    return seg;
+}
+
+/* drop a hold on seg, freeing it and its entries with the last;
+ * caller holds disk_mutex
+ */
+static void segment_put(disk_segment *seg){
+    disk_entry *e, *next;
+
+    if(--seg->refcnt == 0){
+        for(e = seg->entries; e != NULL; e = next){
+            next = e->seg_next;
+            free(e);
+        }
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+/* make seg the newest of the tier's segments; caller holds disk_mutex */
+static void segment_link(disk_segment *seg){
+    if(newest != NULL){
+        newest->next = seg;
+    }
+    else{
+        oldest = seg;
+    }
+    newest = seg;
+    nsegments++;
+}
+
+static void index_grow(void){
+    size_t n = nbuckets * 2, i;
+    disk_entry **b, *e, *next;
+
+    if((b = (disk_entry **)calloc(n, sizeof(disk_entry *))) == NULL){
+        // longer chains, still right
+        return;
+    }
+    for(i = 0; i < nbuckets; i++){
+        for(e = buckets[i]; e != NULL; e = next){
+            next = e->chain;
+            e->chain = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+        }
+    }
+    free(buckets);
+    buckets = b;
+    nbuckets = n;
+}
+
+static disk_entry **index_slot(uint64_t hash, const char *uri){
+    disk_entry **p = &buckets[hash & (nbuckets - 1)];
+
+    for(; *p != NULL; p = &(*p)->chain){
+        if((*p)->hash == hash && strcmp((*p)->uri, uri) == 0){
+            break;
+        }
+    }
+    return p;
+}
+
+static void index_del(disk_entry *e){
+    disk_entry **p = index_slot(e->hash, e->uri);
+
+    *p = e->chain;
+    e->live = 0;
+    nentries--;
+}
+
+/* index the response written at off in seg, replacing any kept for uri,
+ * whose cache_hash is hash, with a copy of its header block hdr; returns
+ * 0 if there is no memory for it. Caller holds disk_mutex.
+ */
+static int index_add(disk_segment *seg, uint64_t hash, char *uri, off_t off,
+        size_t bytes, char *hdr, size_t hdr_len){
+    size_t uri_len = strlen(uri) + 1;
+    disk_entry *e, **p;
+
+    if((e = (disk_entry *)malloc(sizeof(disk_entry) + uri_len
+                    + hdr_len)) == NULL){
+        return 0;
+    }
+    memcpy(e->uri, uri, uri_len);
+    e->hdr = e->uri + uri_len;
+    memcpy(e->hdr, hdr, hdr_len);
+    e->hash = hash;
+    e->seg = seg;
+    e->off = off;
+    e->bytes = bytes;
+    e->hdr_len = hdr_len;
+    e->live = 1;
+    e->seg_next = seg->entries;
+    seg->entries = e;
+    if(*(p = index_slot(e->hash, uri)) != NULL){
+        index_del(*p);
+    }
+    e->chain = buckets[e->hash & (nbuckets - 1)];
+    buckets[e->hash & (nbuckets - 1)] = e;
+    if(++nentries > nbuckets){
+        index_grow();
+    }
+    return 1;
+}
+
+/* remove the oldest segments until the tier is within its size; caller
+ * holds disk_mutex
+ */
+static void disk_evict(void){
+    char path[MAXLINE];
+    disk_segment *seg;
+    disk_entry *e;
+
+    while(disk_size > disk_budget && (seg = oldest) != NULL){
+        if((oldest = seg->next) == NULL){
+            newest = NULL;
+        }
+        if(seg == cur){
+            cur = NULL;
+        }
+        // the entries go with the segment, once no hit holds it
+        for(e = seg->entries; e != NULL; e = e->seg_next){
+            if(e->live){
+                index_del(e);
+            }
+        }
+        disk_size -= seg->size;
+        nsegments--;
+        seg->dead = 1;
+        segment_path(path, seg->id);
+        unlink(path);
+        segment_put(seg);
+    }
+}
+
+static int pwrite_full(int fd, char *buf, size_t n, off_t off){
+    ssize_t w;
+
+    while(n > 0){
+        if((w = pwrite(fd, buf, n, off)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += w;
+        n -= w;
+        off += w;
+    }
+    return 0;
+}
+
+/* append an evicted block to the writer's segment */
+static void disk_write(cache_block *b){
+    http_resp r;
+    disk_segment *seg;
+    off_t off;
+    int hdr_len, ok;
+
+    // the header block is sent apart from the body, which is sendfile's
+    http_resp_init(&r);
+    if((hdr_len = http_resp_header(&r, b->buf, b->bytes)) <= 0){
+        return;
+    }
+    P(&disk_mutex);
+    if(cur != NULL && cur->size > 0 && cur->size + b->bytes > segment_max){
+        // full, it stays as it is
+        cur = NULL;
+    }
+    if(cur == NULL && (cur = segment_open()) != NULL){
+        segment_link(cur);
+    }
+    if((seg = cur) == NULL){
+        V(&disk_mutex);
+        return;
+    }
+    off = seg->size;
+    seg->size += b->bytes;
+    disk_size += b->bytes;
+    seg->refcnt++;
+    V(&disk_mutex);
+
+    ok = pwrite_full(seg->fd, b->buf, b->bytes, off) == 0;
+
+    P(&disk_mutex);
+    if(ok && !seg->dead && index_add(seg, b->hash, b->uri, off, b->bytes,
+                b->buf, hdr_len)){
+        demoted++;
+    }
+    segment_put(seg);
+    disk_evict();
+    V(&disk_mutex);
+}
+
+/* write the next piece of a spill, starting its segment with the first */
+static void spill_piece(disk_job *job){
+    disk_spill *sp = job->sp;
+
+    if(sp->failed){
+        return;
+    }
+    if(sp->seg == NULL){
+        P(&disk_mutex);
+        sp->seg = segment_open();
+        V(&disk_mutex);
+    }
+    if(sp->seg == NULL
+            || pwrite_full(sp->seg->fd, job->data, job->bytes, job->off) < 0){
+        // what is queued behind it is skipped, and the relay told
+        __atomic_store_n(&sp->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* index a complete spill under sp->uri, or remove it, say which and free
+ * the spill
+ */
+static void spill_finish(disk_spill *sp){
+    char path[MAXLINE];
+    disk_segment *seg = sp->seg;
+    int ok = seg != NULL && sp->uri != NULL && !sp->failed;
+
+    if(ok){
+        P(&disk_mutex);
+        if((ok = index_add(seg, cache_hash(sp->uri), sp->uri, 0, sp->len,
+                        sp->hdr, sp->hdr_len))){
+            seg->size = sp->len;
+            segment_link(seg);
+            disk_size += seg->size;
+            disk_evict();
+        }
+        V(&disk_mutex);
+    }
+    if(!ok && seg != NULL){
+        // nothing can find it
+        segment_path(path, seg->id);
+        unlink(path);
+        close(seg->fd);
+        free(seg);
+    }
+    if(sp->done != NULL){
+        sp->done(sp->arg, ok);
+    }
+    free(sp->uri);
+    free(sp->hdr);
+    free(sp);
+}
+
+/* queue job for the writer; returns 0 if it would take the bytes waiting
+ * past DISK_QUEUE_BYTES, unless it must be queued
+ */
+static int queue_put(disk_job *job, int must){
+    P(&queue_mutex);
+    if(!must && queue_bytes + job->bytes > DISK_QUEUE_BYTES){
+        // the disk is behind, don't make anyone wait for it
+        dropped++;
+        V(&queue_mutex);
+        return 0;
+    }
+    queue_bytes += job->bytes;
+    job->next = NULL;
+    if(queue_tail != NULL){
+        queue_tail->next = job;
+    }
+    else{
+        queue_head = job;
+    }
+    queue_tail = job;
+    V(&queue_mutex);
+    V(&queue_items);
+    return 1;
+}
+
+static void *disk_writer(void *arg){
+    disk_job *job;
+    size_t bytes;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+    while(1){
+        P(&queue_items);
+        P(&queue_mutex);
+        job = queue_head;
+        if((queue_head = job->next) == NULL){
+            queue_tail = NULL;
+        }
+        V(&queue_mutex);
+        bytes = job->bytes;
+        switch(job->kind){
+        case JOB_DEMOTE:
+            disk_write(job->b);
+            cache_read_done(job->b);
+            free(job);
+            break;
+        case JOB_SPILL:
+            spill_piece(job);
+            free(job);
+            break;
+        case JOB_FINISH:
+            // the job is part of the spill
+            spill_finish(job->sp);
+            break;
+        }
+        P(&queue_mutex);
+        queue_bytes -= bytes;
+        V(&queue_mutex);
+    }
+    return NULL;
+}
+
+void disk_init(const char *dir, size_t size){
+    char path[MAXLINE];
+    struct dirent *d;
+    pthread_t tid;
+    DIR *dp;
+
+    if(dir == NULL){
+        return;
+    }
+    if((mkdir(dir, 0700) < 0 && errno != EEXIST)
+            || (dp = opendir(dir)) == NULL){
+        fprintf(stderr, "can not use disk cache directory %s: %s\n", dir,
+                strerror(errno));
+        exit(1);
+    }
+    // the index of the last run is gone, and with it what they hold
+    while((d = readdir(dp)) != NULL){
+        if(strncmp(d->d_name, "seg.", 4) == 0){
+            snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dp);
+
+    disk_dir = strdup(dir);
+    disk_budget = size;
+    disk_max = size / DISK_MIN_SEGMENTS;
+    segment_max = disk_max < DISK_SEGMENT ? disk_max : DISK_SEGMENT;
+    nbuckets = DISK_INDEX_INIT;
+    buckets = (disk_entry **)Calloc(nbuckets, sizeof(disk_entry *));
+    Sem_init(&disk_mutex, 0, 1);
+    Sem_init(&queue_mutex, 0, 1);
+    Sem_init(&queue_items, 0, 0);
+    Pthread_create(&tid, NULL, disk_writer, NULL);
+}
+
+size_t disk_max_object(void){
+    return disk_max;
+}
+
+int disk_demote(cache_block *b){
+    disk_job *job;
+
+    if(disk_dir == NULL || b->bytes > disk_max
+            || (job = (disk_job *)malloc(sizeof(disk_job))) == NULL){
+        return 0;
+    }
+    job->kind = JOB_DEMOTE;
+    job->bytes = b->bytes;
+    job->b = b;
+    if(!queue_put(job, 0)){
+        free(job);
+        return 0;
+    }
+    return 1;
+}
+
+int disk_lookup(char *uri, disk_hit *hit){
+    disk_entry *e;
+
+    if(disk_dir == NULL){
+        return 0;
+    }
+    P(&disk_mutex);
+    if((e = *index_slot(cache_hash(uri), uri)) == NULL){
+        V(&disk_mutex);
+        return 0;
+    }
+    e->seg->refcnt++;
+    hit->seg = e->seg;
+    hit->fd = e->seg->fd;
+    hit->off = e->off;
+    hit->bytes = e->bytes;
+    hit->hdr = e->hdr;
+    hit->hdr_len = e->hdr_len;
+    hits++;
+    V(&disk_mutex);
+    return 1;
+}
+
+void disk_hit_done(disk_hit *hit){
+    if(hit->seg == NULL){
+        return;
+    }
+    P(&disk_mutex);
+    segment_put(hit->seg);
+    V(&disk_mutex);
+    hit->seg = NULL;
+}
+
+disk_spill *disk_spill_open(void){
+    disk_spill *sp;
+
+    if(disk_dir == NULL
+            || (sp = (disk_spill *)calloc(1, sizeof(disk_spill))) == NULL){
+        return NULL;
+    }
+    return sp;
+}
+
+int disk_spill_write(disk_spill *sp, char *data, size_t n){
+    http_resp r;
+    disk_job *job;
+    int hdr_len;
+
+    if(n == 0){
+        return 1;
+    }
+    if(sp->len + n > disk_max || __atomic_load_n(&sp->failed,
+                __ATOMIC_RELAXED)){
+        return 0;
+    }
+    if(sp->len == 0){
+        // the whole header block comes in the first piece
+        http_resp_init(&r);
+        if((hdr_len = http_resp_header(&r, data, n)) <= 0
+                || (sp->hdr = (char *)malloc(hdr_len)) == NULL){
+            return 0;
+        }
+        memcpy(sp->hdr, data, hdr_len);
+        sp->hdr_len = hdr_len;
+    }
+    if((job = (disk_job *)malloc(sizeof(disk_job) + n)) == NULL){
+        return 0;
+    }
+    job->kind = JOB_SPILL;
+    job->bytes = n;
+    job->sp = sp;
+    job->off = sp->len;
+    job->data = (char *)(job + 1);
+    memcpy(job->data, data, n);
+    if(!queue_put(job, 0)){
+        free(job);
+        return 0;
+    }
+    sp->len += n;
+    return 1;
+}
+
+/* queue the end of sp, to be indexed under uri or, if it is NULL, thrown
+ * away; behind its pieces, so the writer has them all by then
+ */
+static void spill_end(disk_spill *sp, char *uri,
+        void (*done)(void *arg, int ok), void *arg){
+    sp->uri = uri != NULL && sp->len > 0 ? strdup(uri) : NULL;
+    sp->done = done;
+    sp->arg = arg;
+    sp->finish.kind = JOB_FINISH;
+    sp->finish.bytes = 0;
+    sp->finish.sp = sp;
+    queue_put(&sp->finish, 1);
+}
+
+void disk_spill_commit(disk_spill *sp, char *uri,
+        void (*done)(void *arg, int ok), void *arg){
+    spill_end(sp, uri, done, arg);
+}
+
+void disk_spill_abort(disk_spill *sp){
+    spill_end(sp, NULL, NULL, NULL);
+}
+
+void disk_report(FILE *fp){
+    unsigned long lost;
+
+    if(disk_dir == NULL){
+        return;
+    }
+    P(&queue_mutex);
+    lost = dropped;
+    V(&queue_mutex);
+    P(&disk_mutex);
+    fprintf(fp, "disk: %zu entries, %zu of %zu KB in %d segments, "
+            "%lu hits, %lu written from memory, %lu dropped\n",
+            nentries, disk_size / 1024, disk_budget / 1024, nsegments, hits,
+            demoted, lost);
+    V(&disk_mutex);
+}
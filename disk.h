@@ -0,0 +1,62 @@
+/*
+ * disk.h - second cache tier in segment files on disk
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "cache.h"
+
+#define DISK_DEFAULT_SIZE (1024L * 1024 * 1024) // bytes of segments, -S
+#define DISK_SEGMENT (16 * 1024 * 1024) // bytes written to a segment before
+                                        // the next one is started, at most
+#define DISK_MIN_SEGMENTS 4             // the tier holds at least this many
+                                        // of its largest segments and objects
+#define DISK_QUEUE_BYTES (16 * 1024 * 1024) // of blocks and pieces waiting
+                                        // to be written, at most
+
+typedef struct disk_segment disk_segment;
+typedef struct disk_spill disk_spill;
+
+/* a response found on disk, kept readable until disk_hit_done */
+typedef struct {
+    disk_segment *seg;          // NULL if nothing is held
+    int fd;                     // the segment file
+    off_t off;                  // where the response starts in it
+    size_t bytes;
+    char *hdr;                  // the header block it starts with, in memory
+    size_t hdr_len;
+} disk_hit;
+
+/* keep up to size bytes of responses in segment files under dir; a NULL
+ * dir leaves the tier off
+ */
+void disk_init(const char *dir, size_t size);
+/* the largest response the tier takes, 0 if it is off */
+size_t disk_max_object(void);
+/* queue a block evicted from memory to be written out; the writer holds
+ * a reference until it is. Returns 0 if it won't be.
+ */
+int disk_demote(cache_block *b);
+/* look uri up, holding its segment if it is there; returns 0 if not */
+int disk_lookup(char *uri, disk_hit *hit);
+void disk_hit_done(disk_hit *hit);
+/* have the writer put a response too large for memory in a segment of
+ * its own as it arrives; NULL if the tier is off
+ */
+disk_spill *disk_spill_open(void);
+/* queue the next n bytes; returns 0 if they don't fit, the queue is
+ * full or an earlier piece couldn't be written, and the spill is only
+ * good for disk_spill_abort then
+ */
+int disk_spill_write(disk_spill *sp, char *data, size_t n);
+/* index the complete response under uri once it is written; the writer
+ * thread calls done(arg, ok) then, if done isn't NULL, ok if it was
+ * kept. The spill is gone either way, as it is after disk_spill_abort.
+ */
+void disk_spill_commit(disk_spill *sp, char *uri,
+        void (*done)(void *arg, int ok), void *arg);
+void disk_spill_abort(disk_spill *sp);
+/* print how much is on disk */
+void disk_report(FILE *fp);
+
+#endif /* __DISK_H__ */
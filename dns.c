@@ -0,0 +1,312 @@
+/*
+ * dns.c - resolver cache
+ *
+ * getaddrinfo is slow and every miss used to call it, even for origins
+ * looked up thousands of times a second. Answers are kept here per
+ * host:port for a fixed TTL, failed lookups for a shorter one. When a
+ * name is used in the last part of its TTL a refresher thread looks it
+ * up again in the background, and the old answer keeps being served
+ * until the new one is in, so hot names never wait for the resolver.
+ */
+#include "csapp.h"
+#include "dns.h"
+
+#define DNS_BUCKETS 1024
+#define DNS_MAX_ENTRIES 4096
+#define DNS_REFRESH_AHEAD 4     // refresh in the last 1/4 of the TTL
+
+typedef struct dns_entry dns_entry;
+struct dns_entry{
+    char *host;
+    char *port;
+    dns_addrs *addrs;           // NULL for a failed lookup
+    int err;                    // getaddrinfo error of a failed lookup
+    time_t expires;
+    int refreshing;             // queued for or being refreshed
+    dns_entry *next;            // next entry in the bucket
+};
+
+/* a name waiting for the refresher */
+typedef struct dns_job dns_job;
+struct dns_job{
+    char *host;
+    char *port;
+    dns_job *next;
+};
+
+static dns_entry *buckets[DNS_BUCKETS];
+static int nentries;
+static dns_job *jobs_head, *jobs_tail;
+static sem_t dns_mutex;         // protects the entries and the jobs
+static sem_t jobs;              // number of queued jobs
+static int ttl;
+
+static unsigned long hits, misses, negative_hits, refreshes;
+
+static time_t now_sec(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static char *str_dup(char *s){
+    char *d = (char *)Malloc(strlen(s) + 1);
+
+    strcpy(d, s);
+    return d;
+}
+
+static unsigned name_hash(char *host, char *port){
+    unsigned h = 2166136261u;
+
+    for(; *host; host++){
+        h = (h ^ (unsigned char)*host) * 16777619u;
+    }
+    h = (h ^ ':') * 16777619u;
+    for(; *port; port++){
+        h = (h ^ (unsigned char)*port) * 16777619u;
+    }
+    return h % DNS_BUCKETS;
+}
+
+/* same lookup open_clientfd does */
+static int lookup(char *host, char *port, struct addrinfo **listp){
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    return getaddrinfo(host, port, &hints, listp);
+}
+
+static dns_addrs *addrs_new(struct addrinfo *list){
+    dns_addrs *a = (dns_addrs *)Malloc(sizeof(dns_addrs));
+
+    a->list = list;
+    a->refcnt = 1;
+    return a;
+}
+
+void dns_release(dns_addrs *a){
+    if(a != NULL && __atomic_sub_fetch(&a->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        freeaddrinfo(a->list);
+        Free(a);
+    }
+}
+
+static dns_entry *entry_find(char *host, char *port){
+    dns_entry *e;
+
+    for(e = buckets[name_hash(host, port)]; e != NULL; e = e->next){
+        if(strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* drop expired entries nobody is refreshing; caller holds the mutex */
+static void entries_prune(time_t now){
+    dns_entry **link, *e;
+    int b;
+
+    for(b = 0; b < DNS_BUCKETS; b++){
+        link = &buckets[b];
+        while((e = *link) != NULL){
+            if(now >= e->expires && !e->refreshing){
+                *link = e->next;
+                dns_release(e->addrs);
+                Free(e->host);
+                Free(e->port);
+                Free(e);
+                nentries--;
+            }
+            else{
+                link = &e->next;
+            }
+        }
+    }
+}
+
+/* record the result of a lookup; returns the answer with a reference
+ * for the caller, or NULL if it failed
+ */
+static dns_addrs *entry_store(char *host, char *port, struct addrinfo *list,
+        int rc, int refresh){
+    dns_addrs *a = rc == 0 ? addrs_new(list) : NULL;
+    dns_entry *e;
+    time_t now = now_sec();
+    unsigned b;
+
+    // resource trouble on our side says nothing about the name
+    if(rc == EAI_SYSTEM || rc == EAI_MEMORY){
+        P(&dns_mutex);
+        if(refresh && (e = entry_find(host, port)) != NULL){
+            e->refreshing = 0;
+        }
+        V(&dns_mutex);
+        return NULL;
+    }
+
+    P(&dns_mutex);
+    if((e = entry_find(host, port)) == NULL){
+        if(nentries >= DNS_MAX_ENTRIES){
+            entries_prune(now);
+        }
+        if(nentries >= DNS_MAX_ENTRIES){
+            V(&dns_mutex);
+            return a;
+        }
+        e = (dns_entry *)Calloc(1, sizeof(dns_entry));
+        e->host = str_dup(host);
+        e->port = str_dup(port);
+        b = name_hash(host, port);
+        e->next = buckets[b];
+        buckets[b] = e;
+        nentries++;
+    }
+    if(refresh && a == NULL){
+        // keep the old answer until it expires
+        e->refreshing = 0;
+        V(&dns_mutex);
+        return NULL;
+    }
+    dns_release(e->addrs);
+    e->addrs = a;
+    e->err = rc;
+    e->expires = now + (a != NULL ? ttl : DNS_NEGATIVE_TTL);
+    e->refreshing = 0;
+    if(a != NULL){
+        __atomic_add_fetch(&a->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    V(&dns_mutex);
+    return a;
+}
+
+static void *dns_refresher(void *arg){
+    dns_job *job;
+    struct addrinfo *list;
+    int rc;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+    while(1){
+        P(&jobs);
+        P(&dns_mutex);
+        job = jobs_head;
+        if((jobs_head = job->next) == NULL){
+            jobs_tail = NULL;
+        }
+        V(&dns_mutex);
+
+        rc = lookup(job->host, job->port, &list);
+        dns_release(entry_store(job->host, job->port, list, rc, 1));
+        __atomic_fetch_add(&refreshes, 1, __ATOMIC_RELAXED);
+        Free(job->host);
+        Free(job->port);
+        Free(job);
+    }
+    return NULL;
+}
+
+/* hand e to the refresher; caller holds the mutex */
+static void entry_refresh(dns_entry *e){
+    dns_job *job = (dns_job *)Malloc(sizeof(dns_job));
+
+    e->refreshing = 1;
+    job->host = str_dup(e->host);
+    job->port = str_dup(e->port);
+    job->next = NULL;
+    if(jobs_tail != NULL){
+        jobs_tail->next = job;
+    }
+    else{
+        jobs_head = job;
+    }
+    jobs_tail = job;
+    V(&jobs);
+}
+
+void dns_init(int secs){
+    pthread_t tid;
+
+    Sem_init(&dns_mutex, 0, 1);
+    Sem_init(&jobs, 0, 0);
+    ttl = secs;
+    if(ttl > 0){
+        Pthread_create(&tid, NULL, dns_refresher, NULL);
+    }
+}
+
+dns_addrs *dns_resolve(char *host, char *port, int *err){
+    struct addrinfo *list;
+    dns_addrs *a;
+    dns_entry *e;
+    time_t now;
+
+    if(ttl > 0){
+        now = now_sec();
+        P(&dns_mutex);
+        // a stale answer is still good while its refresh is under way
+        if((e = entry_find(host, port)) != NULL
+                && (now < e->expires || (e->refreshing && e->addrs != NULL))){
+            if((a = e->addrs) != NULL){
+                __atomic_add_fetch(&a->refcnt, 1, __ATOMIC_RELAXED);
+                if(!e->refreshing
+                        && e->expires - now <= ttl / DNS_REFRESH_AHEAD){
+                    entry_refresh(e);
+                }
+                *err = 0;
+                __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+            }
+            else{
+                *err = e->err;
+                __atomic_fetch_add(&negative_hits, 1, __ATOMIC_RELAXED);
+            }
+            V(&dns_mutex);
+            return a;
+        }
+        V(&dns_mutex);
+        __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+    }
+
+    if((*err = lookup(host, port, &list)) != 0){
+        list = NULL;
+    }
+    if(ttl == 0){
+        return *err == 0 ? addrs_new(list) : NULL;
+    }
+    return entry_store(host, port, list, *err, 0);
+}
+
+int dns_open_clientfd(char *host, char *port){
+    dns_addrs *a;
+    int fd, rc;
+
+    if((a = dns_resolve(host, port, &rc)) == NULL){
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n",
+                host, port, gai_strerror(rc));
+        return -2;
+    }
+    fd = open_clientfd_list(a->list);
+    dns_release(a);
+    return fd;
+}
+
+void dns_report(FILE *fp){
+    int n;
+
+    if(ttl == 0){
+        return;
+    }
+    P(&dns_mutex);
+    n = nentries;
+    V(&dns_mutex);
+    fprintf(fp, "dns: %lu hits, %lu misses, %lu negative hits, "
+            "%lu refreshes, %d names\n",
+            __atomic_load_n(&hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&misses, __ATOMIC_RELAXED),
+            __atomic_load_n(&negative_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&refreshes, __ATOMIC_RELAXED), n);
+}
@@ -0,0 +1,28 @@
+/*
+ * dns.h - resolver cache
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#define DNS_DEFAULT_TTL 60      // seconds an answer is kept
+#define DNS_NEGATIVE_TTL 5      // seconds a failed lookup is kept
+
+/* an answer, shared by the cache and the lookups using it */
+typedef struct {
+    struct addrinfo *list;
+    int refcnt;
+} dns_addrs;
+
+/* keep answers for ttl seconds; 0 turns the cache off */
+void dns_init(int ttl);
+/* addresses of host:port; NULL with *err set to the getaddrinfo error if
+ * the name doesn't resolve. Release the answer with dns_release.
+ */
+dns_addrs *dns_resolve(char *host, char *port, int *err);
+void dns_release(dns_addrs *a);
+/* open_clientfd through the cache */
+int dns_open_clientfd(char *host, char *port);
+/* print cache statistics */
+void dns_report(FILE *fp);
+
+#endif /* __DNS_H__ */
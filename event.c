@@ -0,0 +1,1452 @@
+/*
+ * event.c - epoll based event loop
+ *
+ * Every loop thread owns an epoll instance and drives the connections it
+ * accepted as small state machines:
+ *
+ *   read request -> cache lookup -> connect upstream -> send request
+ *                -> read response <-> send response -> read request ...
+ *
+ * The response is relayed piece by piece through a small buffer as it
+ * arrives, so it can be of any size. Once it is clear that a response
+ * won't be cached, the rest of its body is spliced from the origin to
+ * the client through a pipe instead, except on io_uring loops, which
+ * would hand every splice to a kernel worker thread. Origin connections
+ * come from the upstream pool when one is idle, which skips the connect,
+ * and go back to it once their response has been read.
+ * Client connections stay open for the next request as long as the
+ * client can tell where each response ends. Those waiting for a request
+ * are kept on a list, oldest first, which a timerfd checks every second
+ * for connections idle too long. Requests a client pipelines wait in
+ * the request buffer and are served in order once the one before them
+ * is done; a run of them found in the cache is answered with a single
+ * send. A response found in the disk tier instead has its header block,
+ * which the disk index keeps in memory, sent, then its body goes from
+ * the segment file to the client with sendfile; io_uring loops queue
+ * reads of it into the relay buffer on their ring instead. The loops
+ * never touch the disk themselves otherwise: what is kept there is
+ * written by the disk tier's writer thread.
+ * A miss for a URI another connection is already fetching parks until
+ * that fetch is done and then looks in the cache again. The fetch may
+ * run on another loop, so every loop has a mailbox and an eventfd that
+ * wakes it when one of its parked connections can go on.
+ *
+ * All sockets are non-blocking and registered edge-triggered. A
+ * connection has at most one outstanding operation (recv, send or
+ * connect). The operation is tried as soon as it is issued and again
+ * whenever epoll reports activity on one of the connection's sockets.
+ * Once it finishes the connection is put on the loop's ready list and its
+ * state handler runs from there, so operations that complete right away
+ * never recurse into each other.
+ *
+ * With -u the loops use io_uring instead of epoll: operations are queued
+ * on the loop's ring, everything queued while handling one batch of
+ * completions goes to the kernel in a single io_uring_enter, and the
+ * completions are fed to the same state handlers. A loop whose ring
+ * can't be set up falls back to epoll.
+ */
+#define _GNU_SOURCE             /* for splice */
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include "cache.h"
+#include "disk.h"
+#include "proxy.h"
+#include "event.h"
+#include "shard.h"
+#include "uring.h"
+#include "http.h"
+#include "upstream.h"
+#include "dns.h"
+#include "flight.h"
+#include "arena.h"
+
+#define EV_MAX_EVENTS 256       // events taken per epoll_wait
+#define EV_READY_BATCH 1024     // handlers run before polling again
+#define EV_ACCEPT_BATCH 64      // accepts per wakeup, keeps loops balanced
+#define EV_URING_ENTRIES 1024   // submission queue size
+#define EV_URING_CQ_ENTRIES 16384
+#define EV_URING_ACCEPTS 8      // accepts kept queued on a ring
+#define EV_PIPELINE_BATCH 16    // cached responses sent in one go
+#define EV_REQ_BUF 4096         // request bytes received at first, grown
+                                // up to -H for a longer header block
+
+enum conn_state{
+    C_READ_REQUEST,             // reading the request header block
+    C_WAIT_FLIGHT,              // parked until another fetch of the URI ends
+    C_SEND_CACHED,              // writing a cached response
+    C_SEND_DISK,                // writing the header block of one on disk
+    C_READ_DISK,                // reading a piece of its body, on a ring
+    C_SEND_DISK_BODY,           // and sending its body
+    C_CONNECT,                  // connecting to the origin
+    C_SEND_UPSTREAM,            // writing the rewritten request
+    C_READ_RESPONSE,            // reading the origin's response
+    C_SEND_RESPONSE,            // writing the response to the client
+    C_SPLICE_IN,                // splicing the body from the origin ...
+    C_SPLICE_OUT,               // ... and on to the client
+    C_SEND_ERROR                // writing why the request is refused
+};
+
+enum op_kind{
+    OP_NONE,
+    OP_RECV,
+    OP_SEND,
+    OP_CONNECT,
+    OP_SPLICE_IN,               // from op_fd into the pipe op_to, like recv
+    OP_SPLICE_OUT,              // from the pipe op_fd to op_to, like send
+    OP_SENDFILE,                // from the file op_fd at op_off to op_to
+    OP_READ                     // from the file op_fd at op_off, rings only
+};
+
+typedef struct ev_loop ev_loop;
+typedef struct conn conn;
+
+struct conn{
+    ev_loop *loop;
+    int state;
+    int clientfd;
+    int serverfd;               // -1 while not talking to the origin
+    int reused;                 // serverfd came from the upstream pool
+    int keep_alive;             // wait for another request after this one
+    int requests;               // requests taken on this connection
+
+    int op;                     // outstanding operation
+    int op_fd;
+    int op_to;                  // where a splice or sendfile goes
+    off_t op_off;               // where a sendfile or read is in op_fd
+    char *op_buf;
+    size_t op_len;
+    size_t op_done;             // bytes sent so far (OP_SEND)
+    ssize_t op_res;             // result handed to the state handler
+    struct iovec op_iov[3 * EV_PIPELINE_BATCH]; // what OP_SEND sends
+    int op_iovcnt;
+    int op_iovpos;              // first iovec not sent in full
+    struct msghdr op_msg;
+    conn *next_ready;
+
+    int idle;                   // on the loop's idle list
+    time_t idle_since;
+    conn *idle_prev;
+    conn *idle_next;
+
+    char *req;                  // request header block, then any
+    size_t req_len;             // requests pipelined behind it
+    size_t req_cap;
+    size_t req_hdr;             // length of the one being served
+    int pending;                // the next request is parsed already
+    const char *reject;         // answer sent before closing, or NULL
+    arena *arena;               // held while requests are being served
+    size_t arena_base;          // the request's own buffers start here
+    size_t arena_mark;          // the response copy starts here
+    char *forward_buf;          // these from the arena, for one request
+    int num_forward;
+    char *host;
+    char *port;
+    char *uri;
+
+    dns_addrs *addrs;           // origin addresses
+    struct addrinfo *cur_addr;  // the one being connected to
+    cache_block *cached[EV_PIPELINE_BATCH]; // entries referenced
+    int ncached;                            // being sent
+    disk_hit disk;              // the response on disk being sent
+    size_t disk_sent;           // bytes of it sent so far
+    flight *flight;             // fetch others wait on, while leading it
+    int client_gone;            // the client failed, fetching for them only
+    char *relay_buf;            // RELAY_BUF_SIZE bytes in transit, from the arena
+    size_t relay_len;
+    size_t bytes_response;      // response bytes relayed so far
+    resp_copy copy;             // kept for the cache while it may fit
+    int pipefd[2];              // for splicing, -1 until needed
+    http_resp resp;             // framing of the response being read
+};
+
+struct ev_loop{
+    int epfd;
+    int listenfd;
+    int shard;                  // listener shard owned, or -1 if shared
+    uring_t *ring;              // io_uring backend, NULL for epoll
+    int accepts;                // accepts queued on the ring
+    int wakefd;                 // eventfd, written when mail arrives
+    uint64_t wake_buf;          // where the ring reads it into
+    sem_t mail_mutex;
+    conn *mail;                 // parked connections woken by others
+    int tickfd;                 // timerfd for the idle check
+    uint64_t tick_buf;
+    conn *idle_head;            // connections waiting for a request,
+    conn *idle_tail;            // oldest first
+    conn *ready_head;           // connections whose operation finished
+    conn *ready_tail;
+};
+
+static void set_nonblock(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* watch fd for everything at once; edge-triggered, so this is done once */
+static int ev_add(ev_loop *loop, int fd, conn *c){
+    struct epoll_event ev;
+
+    if(loop->ring != NULL){
+        return 0;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* stop watching fd, e.g. before another loop may take it over */
+static void ev_del(ev_loop *loop, int fd){
+    if(loop->ring == NULL){
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+/* point op_msg at what is left of the send */
+static struct msghdr *op_msg(conn *c){
+    c->op_msg.msg_iov = c->op_iov + c->op_iovpos;
+    c->op_msg.msg_iovlen = c->op_iovcnt - c->op_iovpos;
+    return &c->op_msg;
+}
+
+/* n more bytes of the send went out */
+static void op_advance(conn *c, size_t n){
+    struct iovec *v;
+
+    c->op_done += n;
+    for(; c->op_iovpos < c->op_iovcnt; c->op_iovpos++){
+        v = &c->op_iov[c->op_iovpos];
+        if(n < v->iov_len){
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            break;
+        }
+        n -= v->iov_len;
+    }
+}
+
+static void op_finish(conn *c, ssize_t res){
+    ev_loop *loop = c->loop;
+
+    c->op = OP_NONE;
+    c->op_res = res;
+    c->next_ready = NULL;
+    if(loop->ready_tail != NULL){
+        loop->ready_tail->next_ready = c;
+    }
+    else{
+        loop->ready_head = c;
+    }
+    loop->ready_tail = c;
+}
+
+/* try the outstanding operation, leave it pending if it would block */
+static void op_try(conn *c){
+    ssize_t n;
+    int err;
+    socklen_t errlen = sizeof(err);
+
+    switch(c->op){
+    case OP_RECV:
+    case OP_SPLICE_IN:
+        do{
+            if(c->op == OP_RECV){
+                n = recv(c->op_fd, c->op_buf, c->op_len, 0);
+            }
+            else{
+                n = splice(c->op_fd, NULL, c->op_to, NULL, c->op_len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            }
+        }while(n < 0 && errno == EINTR);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        op_finish(c, n);
+        break;
+    case OP_SEND:
+    case OP_SPLICE_OUT:
+    case OP_SENDFILE:
+        while(c->op_done < c->op_len){
+            if(c->op == OP_SEND){
+                n = sendmsg(c->op_fd, op_msg(c), MSG_NOSIGNAL);
+            }
+            else if(c->op == OP_SENDFILE){
+                n = sendfile(c->op_to, c->op_fd, &c->op_off,
+                        c->op_len - c->op_done);
+            }
+            else{
+                n = splice(c->op_fd, NULL, c->op_to, NULL,
+                        c->op_len - c->op_done,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            }
+            if(n < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    return;
+                }
+                op_finish(c, -1);
+                return;
+            }
+            if(n == 0 && c->op == OP_SENDFILE){
+                // the segment ends before the object does
+                op_finish(c, -1);
+                return;
+            }
+            op_advance(c, n);
+        }
+        op_finish(c, c->op_done);
+        break;
+    case OP_CONNECT:
+        if(getsockopt(c->op_fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0
+                || err != 0){
+            op_finish(c, -1);
+            return;
+        }
+        // connecting again tells whether the handshake is done yet
+        if(connect(c->op_fd, c->cur_addr->ai_addr,
+                    c->cur_addr->ai_addrlen) == 0 || errno == EISCONN){
+            op_finish(c, 0);
+        }
+        else if(errno != EALREADY && errno != EINPROGRESS){
+            op_finish(c, -1);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* queue the outstanding operation, or what is left of a send, on the ring */
+static void op_submit(conn *c){
+    uring_t *r = c->loop->ring;
+    int rc;
+
+    switch(c->op){
+    case OP_RECV:
+        rc = uring_recv(r, c->op_fd, c->op_buf, c->op_len, c);
+        break;
+    case OP_SEND:
+        if(c->op_done == c->op_len){
+            op_finish(c, c->op_done);
+            return;
+        }
+        if(c->op_iovcnt - c->op_iovpos == 1){
+            rc = uring_send(r, c->op_fd, c->op_iov[c->op_iovpos].iov_base,
+                    c->op_iov[c->op_iovpos].iov_len, c);
+        }
+        else{
+            rc = uring_sendmsg(r, c->op_fd, op_msg(c), c);
+        }
+        break;
+    case OP_CONNECT:
+        rc = uring_connect(r, c->op_fd, c->cur_addr->ai_addr,
+                c->cur_addr->ai_addrlen, c);
+        break;
+    case OP_READ:
+        rc = uring_read(r, c->op_fd, c->op_buf, c->op_len, c->op_off, c);
+        break;
+    default:
+        return;
+    }
+    if(rc < 0){
+        op_finish(c, -1);
+    }
+}
+
+static void op_start(conn *c, int op, int fd, char *buf, size_t len){
+    c->op = op;
+    c->op_fd = fd;
+    c->op_buf = buf;
+    c->op_len = len;
+    c->op_done = 0;
+    if(c->loop->ring != NULL){
+        op_submit(c);
+    }
+    else{
+        op_try(c);
+    }
+}
+
+/* send the iovcnt iovecs set up in op_iov */
+static void op_sendv(conn *c, int fd, int iovcnt){
+    size_t len = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; i++){
+        len += c->op_iov[i].iov_len;
+    }
+    c->op_iovcnt = iovcnt;
+    c->op_iovpos = 0;
+    op_start(c, OP_SEND, fd, NULL, len);
+}
+
+static void op_send(conn *c, int fd, char *buf, size_t len){
+    c->op_iov[0].iov_base = buf;
+    c->op_iov[0].iov_len = len;
+    op_sendv(c, fd, 1);
+}
+
+static void op_connect(conn *c){
+    c->op_fd = c->serverfd;
+    if(c->loop->ring != NULL){
+        c->op = OP_CONNECT;
+        op_submit(c);
+    }
+    else if(connect(c->serverfd, c->cur_addr->ai_addr,
+                c->cur_addr->ai_addrlen) == 0){
+        op_finish(c, 0);
+    }
+    else if(errno == EINPROGRESS){
+        c->op = OP_CONNECT;
+    }
+    else{
+        op_finish(c, -1);
+    }
+}
+
+static void idle_add(conn *c){
+    ev_loop *loop = c->loop;
+
+    c->idle = 1;
+    c->idle_since = time(NULL);
+    c->idle_next = NULL;
+    c->idle_prev = loop->idle_tail;
+    if(loop->idle_tail != NULL){
+        loop->idle_tail->idle_next = c;
+    }
+    else{
+        loop->idle_head = c;
+    }
+    loop->idle_tail = c;
+}
+
+static void idle_del(conn *c){
+    ev_loop *loop = c->loop;
+
+    if(!c->idle){
+        return;
+    }
+    c->idle = 0;
+    if(c->idle_prev != NULL){
+        c->idle_prev->idle_next = c->idle_next;
+    }
+    else{
+        loop->idle_head = c->idle_next;
+    }
+    if(c->idle_next != NULL){
+        c->idle_next->idle_prev = c->idle_prev;
+    }
+    else{
+        loop->idle_tail = c->idle_prev;
+    }
+}
+
+/* hang up on connections that waited client_idle seconds for a request;
+ * their recv ends and the state handler closes them as usual
+ */
+static void idle_expire(ev_loop *loop){
+    time_t now = time(NULL);
+    conn *c;
+
+    while((c = loop->idle_head) != NULL
+            && now - c->idle_since > client_idle){
+        idle_del(c);
+        shutdown(c->clientfd, SHUT_RDWR);
+    }
+}
+
+/* release the cache entries that were sent */
+static void cached_done(conn *c){
+    int i;
+
+    for(i = 0; i < c->ncached; i++){
+        cache_read_done(c->cached[i]);
+    }
+    c->ncached = 0;
+}
+
+/* take an arena for the buffers of the requests about to be served */
+static int conn_arena_get(conn *c){
+    if((c->arena = arena_get()) == NULL){
+        return -1;
+    }
+    c->relay_buf = (char *)arena_alloc(c->arena, RELAY_BUF_SIZE);
+    c->arena_base = arena_used(c->arena);
+    return 0;
+}
+
+/* nothing is being served anymore: give the arena back, so a connection
+ * waiting for its next request holds no more than its conn
+ */
+static void conn_arena_put(conn *c){
+    resp_copy_free(&c->copy);
+    if(c->arena != NULL){
+        arena_put(c->arena);
+        c->arena = NULL;
+    }
+}
+
+static void conn_close(conn *c){
+    idle_del(c);
+    if(c->flight != NULL){
+        // let the followers fetch it themselves
+        flight_done(c->flight, 0);
+    }
+    cached_done(c);
+    disk_hit_done(&c->disk);
+    dns_release(c->addrs);
+    if(c->serverfd >= 0){
+        close(c->serverfd);
+    }
+    close(c->clientfd);
+    if(c->pipefd[0] >= 0){
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    conn_arena_put(c);
+    free(c->req);
+    free(c);
+}
+
+/* hang up on a client whose request won't be served, telling it why
+ * first if its request was refused
+ */
+static void conn_reject(conn *c){
+    const char *reason = c->reject;
+
+    if(reason == NULL){
+        conn_close(c);
+        return;
+    }
+    idle_del(c);
+    c->reject = NULL;
+    c->state = C_SEND_ERROR;
+    op_send(c, c->clientfd, (char *)reason, strlen(reason));
+}
+
+/* connect to the next address of the origin that takes a socket */
+static void connect_next(conn *c){
+    struct addrinfo *p;
+    int fd;
+
+    p = c->cur_addr != NULL ? c->cur_addr->ai_next : c->addrs->list;
+    for(; p != NULL; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+            continue;
+        }
+        set_nonblock(fd);
+        if(ev_add(c->loop, fd, c) < 0){
+            close(fd);
+            continue;
+        }
+        c->serverfd = fd;
+        c->cur_addr = p;
+        c->state = C_CONNECT;
+        op_connect(c);
+        return;
+    }
+    fprintf(stderr, "Error connecting to %s:%s\n", c->host, c->port);
+    conn_close(c);
+}
+
+/* look the origin up and open a new connection to it */
+static void connect_origin(conn *c){
+    int rc;
+
+    // names missing from the resolver cache still block this loop
+    if((c->addrs = dns_resolve(c->host, c->port, &rc)) == NULL){
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n",
+                c->host, c->port, gai_strerror(rc));
+        conn_close(c);
+        return;
+    }
+    c->cur_addr = NULL;
+    connect_next(c);
+}
+
+static void send_upstream(conn *c){
+    c->state = C_SEND_UPSTREAM;
+    op_send(c, c->serverfd, c->forward_buf, c->num_forward);
+}
+
+static void start_connect(conn *c){
+    int fd;
+
+    if((fd = upstream_get(c->host, c->port)) >= 0){
+        if(ev_add(c->loop, fd, c) == 0){
+            c->serverfd = fd;
+            c->reused = 1;
+            send_upstream(c);
+            return;
+        }
+        close(fd);
+    }
+    c->reused = 0;
+    connect_origin(c);
+}
+
+/* the origin closed the pooled connection, go again on a new one */
+static void retry_upstream(conn *c){
+    upstream_stale();
+    close(c->serverfd);
+    c->serverfd = -1;
+    c->reused = 0;
+    connect_origin(c);
+}
+
+/* done with the origin: pool the connection if the response left it
+ * ready for another request, close it otherwise
+ */
+static void release_upstream(conn *c){
+    if(c->resp.state == HR_DONE && c->resp.keep_alive){
+        ev_del(c->loop, c->serverfd);
+        upstream_put(c->host, c->port, c->serverfd);
+    }
+    else{
+        close(c->serverfd);
+    }
+    c->serverfd = -1;
+}
+
+/* drop the request served last from the front of c->req */
+static void req_consume(conn *c){
+    if(c->req_hdr == 0){
+        return;
+    }
+    c->req_len -= c->req_hdr;
+    memmove(c->req, c->req + c->req_hdr, c->req_len);
+    c->req_hdr = 0;
+}
+
+/* parse the request at the front of c->req if its header block is all
+ * there; returns 1 if it was, 0 if more has to be read, -1 if it is bad
+ */
+static int take_request(conn *c){
+    http_req r;
+    int hdr_len, rc;
+
+    if((rc = hdr_len = http_req_parse(&r, c->req, c->req_len)) == 0){
+        if(c->req_len >= (size_t)client_max_header){
+            fprintf(stderr, "request header too large\n");
+            c->reject = header_too_large;
+            return -1;
+        }
+        return 0;
+    }
+    if(hdr_len > 0){
+        if(c->arena == NULL && conn_arena_get(c) < 0){
+            fprintf(stderr, "out of memory for a request\n");
+            return -1;
+        }
+        // the request's buffers replace the last one's
+        arena_reset(c->arena, c->arena_base);
+        rc = c->num_forward = rewrite_request(&r, c->req, c->arena,
+                &c->forward_buf, &c->host, &c->port, &c->uri);
+        c->arena_mark = arena_used(c->arena);
+    }
+    if(rc < 0){
+        c->reject = rc == HTTP_TOO_LARGE ? header_too_large
+            : header_bad_request;
+        fprintf(stdout, "error parsing request\n");
+        return -1;
+    }
+    // the requests pipelined behind it stay for later
+    c->req_hdr = hdr_len;
+    c->keep_alive = r.keep_alive;
+    if(++c->requests >= client_max_requests){
+        c->keep_alive = 0;
+    }
+    return 1;
+}
+
+/* add the cached response for c->uri to the send being put together in
+ * op_iov; returns 0 if it isn't cached
+ */
+static int add_cached(conn *c){
+    cache_block *e;
+
+    if((e = cache_exist(c->uri)) == NULL){
+        return 0;
+    }
+    // the entry stays referenced until it is sent
+    c->cached[c->ncached++] = e;
+    // it was stored without hop-by-hop fields, add our Connection field
+    http_resp_init(&c->resp);
+    http_resp_header(&c->resp, e->buf, e->bytes);
+    c->keep_alive = c->keep_alive && http_resp_framed(&c->resp);
+    c->op_iovcnt += http_conn_iov(c->op_iov + c->op_iovcnt, e->buf, e->bytes,
+            c->keep_alive);
+    return 1;
+}
+
+/* send the response from the cache if it is there, along with those of
+ * the requests pipelined right behind it that are cached too
+ */
+static int serve_cached(conn *c){
+    int rc;
+
+    c->op_iovcnt = 0;
+    if(!add_cached(c)){
+        return 0;
+    }
+    while(c->keep_alive && c->ncached < EV_PIPELINE_BATCH){
+        req_consume(c);
+        if((rc = take_request(c)) <= 0){
+            if(rc < 0){
+                // answer what came before it, then refuse it and hang up
+                c->keep_alive = 0;
+            }
+            break;
+        }
+        if(!add_cached(c)){
+            // fetch this one once the others are out
+            c->pending = 1;
+            break;
+        }
+    }
+    c->state = C_SEND_CACHED;
+    op_sendv(c, c->clientfd, c->op_iovcnt);
+    return 1;
+}
+
+/* send the response from the disk tier if it is there, starting with
+ * its header block and our Connection field; returns 0 if it isn't
+ */
+static int serve_disk(conn *c){
+    disk_hit *h = &c->disk;
+
+    if(!disk_lookup(c->uri, h)){
+        return 0;
+    }
+    // the hit holds the header block in memory until it is done
+    http_resp_init(&c->resp);
+    http_resp_header(&c->resp, h->hdr, h->hdr_len);
+    c->keep_alive = c->keep_alive && http_resp_framed(&c->resp);
+    c->disk_sent = h->hdr_len;
+    c->state = C_SEND_DISK;
+    op_sendv(c, c->clientfd, http_conn_iov(c->op_iov, h->hdr, h->hdr_len,
+                c->keep_alive));
+    return 1;
+}
+
+/* a parked connection's leader is done; runs on the leader's
+ * thread, or the disk writer's for a response it spilled
+ */
+static void flight_wake(void *waiter, int ok){
+    conn *c = (conn *)waiter;
+    ev_loop *loop = c->loop;
+    uint64_t one = 1;
+
+    (void)ok;   // the connection looks in the cache either way
+    P(&loop->mail_mutex);
+    c->next_ready = loop->mail;
+    loop->mail = c;
+    V(&loop->mail_mutex);
+    if(write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        fprintf(stderr, "eventfd write error: %s\n", strerror(errno));
+    }
+}
+
+/* run the connections other threads woke */
+static void mail_drain(ev_loop *loop){
+    conn *c, *next;
+
+    P(&loop->mail_mutex);
+    c = loop->mail;
+    loop->mail = NULL;
+    V(&loop->mail_mutex);
+    for(; c != NULL; c = next){
+        next = c->next_ready;
+        op_finish(c, 0);
+    }
+}
+
+/* receive more of the client's requests behind the c->req_len bytes in
+ * c->req, growing it once it is full of an unfinished header block
+ */
+static void recv_request(conn *c){
+    size_t cap = c->req_cap;
+    char *req;
+
+    if(c->req_len == cap){
+        // take_request refuses header blocks of -H bytes and more
+        cap = cap == 0 ? EV_REQ_BUF : cap * 2;
+        if(cap > (size_t)client_max_header){
+            cap = client_max_header;
+        }
+        if((req = realloc(c->req, cap)) == NULL){
+            fprintf(stderr, "out of memory for a request\n");
+            conn_close(c);
+            return;
+        }
+        c->req = req;
+        c->req_cap = cap;
+    }
+    op_start(c, OP_RECV, c->clientfd, c->req + c->req_len,
+            c->req_cap - c->req_len);
+}
+
+/* wait for the client's next request */
+static void read_request(conn *c){
+    char *req;
+
+    conn_arena_put(c);
+    if(c->req_cap > EV_REQ_BUF && c->req_len <= EV_REQ_BUF
+            && (req = realloc(c->req, EV_REQ_BUF)) != NULL){
+        // an idle connection doesn't keep a long request's room
+        c->req = req;
+        c->req_cap = EV_REQ_BUF;
+    }
+    c->state = C_READ_REQUEST;
+    idle_add(c);
+    recv_request(c);
+}
+
+/* serve the request take_request parsed */
+static void start_request(conn *c){
+    flight *f;
+    size_t cap;
+    char *buf;
+    int leader;
+
+    // a miss copies the response into what is left of the arena
+    arena_reset(c->arena, c->arena_mark);
+    buf = arena_alloc_rest(c->arena, &cap);
+    resp_copy_init(&c->copy, buf, cap);
+    if(serve_cached(c) || serve_disk(c)){
+        return;
+    }
+    f = flight_join(c->uri, &leader);
+    if(!leader){
+        c->state = C_WAIT_FLIGHT;
+        flight_park(f, flight_wake, c);
+        return;
+    }
+    c->flight = f;
+    start_connect(c);
+}
+
+/* read the next piece of the response into the relay buffer */
+static void read_response(conn *c){
+    c->state = C_READ_RESPONSE;
+    op_start(c, OP_RECV, c->serverfd, c->relay_buf + c->relay_len,
+            RELAY_BUF_SIZE - c->relay_len);
+}
+
+/* splice the next piece of the body into the pipe */
+static void splice_in(conn *c){
+    long long left = http_resp_opaque(&c->resp);
+
+    c->state = C_SPLICE_IN;
+    c->op_to = c->pipefd[1];
+    op_start(c, OP_SPLICE_IN, c->serverfd, NULL,
+            left > 0 && left < SPLICE_CHUNK ? left : SPLICE_CHUNK);
+}
+
+/* go on with the response once the relay buffer has been sent: splice
+ * the rest of the body if it won't be cached, read it otherwise
+ */
+static void relay_next(conn *c){
+    if(relay_splice && c->loop->ring == NULL && c->copy.dropped
+            && http_resp_opaque(&c->resp) != 0
+            && (c->pipefd[0] >= 0
+                || pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) == 0)){
+        splice_in(c);
+    }
+    else{
+        read_response(c);
+    }
+}
+
+/* the response is out: go on with the client's next request if the
+ * connection stays open, close it otherwise
+ */
+static void conn_done(conn *c){
+    int rc;
+
+    if(!c->keep_alive && !c->pending){
+        conn_reject(c);
+        return;
+    }
+    if(c->flight != NULL){
+        flight_done(c->flight, 0);
+        c->flight = NULL;
+    }
+    resp_copy_free(&c->copy);
+    c->bytes_response = 0;
+    if(c->pending){
+        c->pending = 0;
+        start_request(c);
+        return;
+    }
+    // the client may have pipelined the next one already
+    req_consume(c);
+    if((rc = take_request(c)) < 0){
+        conn_reject(c);
+    }
+    else if(rc == 0){
+        read_request(c);
+    }
+    else{
+        start_request(c);
+    }
+}
+
+/* the response has been relayed; cache it if it is complete and fits,
+ * which finishes the flight
+ */
+static void relay_done(conn *c){
+    if(c->resp.state == HR_DONE && !c->copy.dropped){
+        resp_copy_store(&c->copy, c->uri, c->flight);
+        c->flight = NULL;
+    }
+    if(c->resp.state != HR_DONE){
+        // the client can't tell where a short response ends
+        c->keep_alive = 0;
+    }
+    conn_done(c);
+}
+
+/* the relay buffer is out, or nobody is left to send it to */
+static void relay_sent(conn *c){
+    c->bytes_response += c->relay_len;
+    c->relay_len = 0;
+    if(c->serverfd >= 0){
+        relay_next(c);
+        return;
+    }
+    relay_done(c);
+}
+
+/* the client is gone: keep reading the response if it is still being
+ * copied for followers of the flight; returns 0 if it isn't
+ */
+static int fetch_for_followers(conn *c){
+    if(c->flight == NULL || c->copy.dropped || !flight_waiting(c->flight)){
+        return 0;
+    }
+    c->client_gone = 1;
+    c->keep_alive = 0;
+    c->pending = 0;
+    c->reject = NULL;
+    return 1;
+}
+
+/* send the rest of the body on disk, or go on once it is out */
+static void send_disk_body(conn *c){
+    disk_hit *h = &c->disk;
+    size_t left = h->bytes - c->disk_sent;
+
+    if(left == 0){
+        disk_hit_done(h);
+        conn_done(c);
+        return;
+    }
+    c->op_off = h->off + c->disk_sent;
+    if(c->loop->ring == NULL){
+        c->state = C_SEND_DISK_BODY;
+        c->op_to = c->clientfd;
+        op_start(c, OP_SENDFILE, h->fd, NULL, left);
+        return;
+    }
+    // a ring can't sendfile, read it through the relay buffer
+    c->state = C_READ_DISK;
+    op_start(c, OP_READ, h->fd, c->relay_buf, left < RELAY_BUF_SIZE ? left
+            : RELAY_BUF_SIZE);
+}
+
+/* advance the connection after its operation finished */
+static void conn_run(conn *c){
+    ssize_t res = c->op_res;
+    size_t used;
+    int rc, with_hdr = 0;
+
+    switch(c->state){
+    case C_READ_REQUEST:
+        if(res <= 0){
+            conn_close(c);
+            return;
+        }
+        c->req_len += res;
+        if((rc = take_request(c)) < 0){
+            conn_reject(c);
+        }
+        else if(rc == 0){
+            recv_request(c);
+        }
+        else{
+            idle_del(c);
+            start_request(c);
+        }
+        break;
+    case C_WAIT_FLIGHT:
+        // if the leader's response didn't make it, fetch it ourselves
+        if(!serve_cached(c) && !serve_disk(c)){
+            start_connect(c);
+        }
+        break;
+    case C_SEND_CACHED:
+        if(res != (ssize_t)c->op_len){
+            fprintf(stderr, "Error writing to back to client\n");
+            conn_close(c);
+            return;
+        }
+        cached_done(c);
+        conn_done(c);
+        break;
+    case C_READ_DISK:
+        if(res <= 0){
+            fprintf(stderr, "Error reading from the disk cache\n");
+            conn_close(c);
+            return;
+        }
+        c->state = C_SEND_DISK_BODY;
+        op_send(c, c->clientfd, c->relay_buf, res);
+        break;
+    case C_SEND_DISK:
+    case C_SEND_DISK_BODY:
+        if(res != (ssize_t)c->op_len){
+            fprintf(stderr, "Error writing to back to client\n");
+            conn_close(c);
+            return;
+        }
+        if(c->state == C_SEND_DISK_BODY){
+            c->disk_sent += res;
+        }
+        send_disk_body(c);
+        break;
+    case C_CONNECT:
+        if(res < 0){
+            close(c->serverfd);
+            c->serverfd = -1;
+            connect_next(c);
+            return;
+        }
+        dns_release(c->addrs);
+        c->addrs = NULL;
+        c->cur_addr = NULL;
+        send_upstream(c);
+        break;
+    case C_SEND_UPSTREAM:
+        if(res < 0 && c->reused){
+            retry_upstream(c);
+            return;
+        }
+        if(res < 0){
+            fprintf(stderr, "Error writing to server\n");
+            conn_close(c);
+            return;
+        }
+        http_resp_init(&c->resp);
+        c->relay_len = 0;
+        read_response(c);
+        break;
+    case C_READ_RESPONSE:
+        if(res <= 0 && c->bytes_response + c->relay_len == 0 && c->reused){
+            retry_upstream(c);
+            return;
+        }
+        if(res < 0){
+            fprintf(stderr, "Error reading response from server\n");
+        }
+        else if(res == 0){
+            http_resp_eof(&c->resp);
+        }
+        else{
+            used = http_resp_feed(&c->resp, c->relay_buf, c->relay_len, res);
+            c->relay_len += used;
+            if(used < (size_t)res){
+                // anything after the end isn't ours, don't reuse it
+                c->resp.keep_alive = 0;
+            }
+            if(c->resp.state == HR_HEADER){
+                if(c->relay_len < RELAY_BUF_SIZE){
+                    // the header block is parsed in one piece
+                    read_response(c);
+                    return;
+                }
+                // too big to parse, relay it until the origin closes
+                c->resp.state = HR_ERROR;
+                c->resp.keep_alive = 0;
+            }
+            if(c->bytes_response == 0){
+                // the header block is in: the Connection field is ours
+                c->keep_alive = c->keep_alive
+                    && http_resp_framed(&c->resp);
+                if(c->resp.state != HR_ERROR){
+                    c->relay_len = http_resp_strip(&c->resp, c->relay_buf,
+                            c->relay_len);
+                    with_hdr = 1;
+                }
+            }
+            if(http_resp_opaque(&c->resp) > 0){
+                resp_copy_expect(&c->copy, c->bytes_response
+                        + c->relay_len + http_resp_opaque(&c->resp));
+            }
+        }
+        if(res <= 0 || c->resp.state == HR_DONE){
+            // nothing more to read from the origin
+            release_upstream(c);
+        }
+        if(c->relay_len == 0){
+            relay_done(c);
+            return;
+        }
+        resp_copy_append(&c->copy, c->relay_buf, c->relay_len);
+        if(c->client_gone){
+            if(c->copy.dropped){
+                // the followers will fetch it themselves
+                conn_close(c);
+                return;
+            }
+            relay_sent(c);
+            return;
+        }
+        c->state = C_SEND_RESPONSE;
+        if(with_hdr){
+            op_sendv(c, c->clientfd, http_conn_iov(c->op_iov, c->relay_buf,
+                        c->relay_len, c->keep_alive));
+        }
+        else{
+            op_send(c, c->clientfd, c->relay_buf, c->relay_len);
+        }
+        break;
+    case C_SEND_RESPONSE:
+        if(res != (ssize_t)c->op_len){
+            fprintf(stderr, "Error writing to back to client\n");
+            if(!fetch_for_followers(c)){
+                conn_close(c);
+                return;
+            }
+        }
+        relay_sent(c);
+        break;
+    case C_SPLICE_IN:
+        if(res < 0){
+            fprintf(stderr, "Error reading response from server\n");
+        }
+        else if(res == 0){
+            http_resp_eof(&c->resp);
+        }
+        else{
+            http_resp_skip(&c->resp, res);
+        }
+        if(res <= 0 || c->resp.state == HR_DONE){
+            release_upstream(c);
+        }
+        if(res <= 0){
+            relay_done(c);
+            return;
+        }
+        c->state = C_SPLICE_OUT;
+        c->op_to = c->clientfd;
+        op_start(c, OP_SPLICE_OUT, c->pipefd[0], NULL, res);
+        break;
+    case C_SPLICE_OUT:
+        if(res != (ssize_t)c->op_len){
+            fprintf(stderr, "Error writing to back to client\n");
+            conn_close(c);
+            return;
+        }
+        c->bytes_response += res;
+        if(c->serverfd >= 0){
+            splice_in(c);
+            return;
+        }
+        relay_done(c);
+        break;
+    case C_SEND_ERROR:
+        conn_close(c);
+        break;
+    }
+}
+
+static void run_ready(ev_loop *loop){
+    conn *c;
+    int n;
+
+    for(n = 0; n < EV_READY_BATCH && (c = loop->ready_head) != NULL; n++){
+        loop->ready_head = c->next_ready;
+        if(loop->ready_head == NULL){
+            loop->ready_tail = NULL;
+        }
+        conn_run(c);
+    }
+}
+
+/* start serving a newly accepted client */
+static void conn_open(ev_loop *loop, int fd){
+    conn *c;
+
+    if(loop->shard >= 0){
+        shard_accepted(loop->shard);
+    }
+    set_nonblock(fd);
+    if((c = calloc(1, sizeof(conn))) == NULL){
+        close(fd);
+        return;
+    }
+    c->loop = loop;
+    c->clientfd = fd;
+    c->serverfd = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    if(ev_add(loop, fd, c) < 0){
+        close(fd);
+        free(c);
+        return;
+    }
+    if(DEBUG){
+        printf("Accepted connection on fd %d\n", fd);
+    }
+    read_request(c);
+}
+
+static void accept_clients(ev_loop *loop){
+    int fd, n;
+
+    for(n = 0; n < EV_ACCEPT_BATCH; n++){
+        if((fd = accept(loop->listenfd, NULL, NULL)) < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            }
+            return;
+        }
+        conn_open(loop, fd);
+    }
+}
+
+/* hand a completion from the ring to whoever queued the operation */
+static void op_complete(ev_loop *loop, conn *c, int res){
+    if(c == NULL){
+        // one of the loop's accepts
+        loop->accepts--;
+        if(res >= 0){
+            conn_open(loop, res);
+        }
+        else if(res != -EAGAIN && res != -EINTR && res != -ECONNABORTED){
+            fprintf(stderr, "accept error: %s\n", strerror(-res));
+        }
+        return;
+    }
+    switch(c->op){
+    case OP_RECV:
+        op_finish(c, res >= 0 ? res : -1);
+        break;
+    case OP_SEND:
+        if(res <= 0){
+            op_finish(c, -1);
+            return;
+        }
+        op_advance(c, res);
+        op_submit(c);
+        break;
+    case OP_CONNECT:
+        op_finish(c, res == 0 ? 0 : -1);
+        break;
+    case OP_READ:
+        op_finish(c, res >= 0 ? res : -1);
+        break;
+    default:
+        break;
+    }
+}
+
+/* keep a read queued on the eventfd; its completion carries the loop
+ * itself as user_data
+ */
+static void wake_queue(ev_loop *loop){
+    if(uring_read(loop->ring, loop->wakefd, &loop->wake_buf,
+                sizeof(loop->wake_buf), 0, loop) < 0){
+        unix_error("io_uring queue full");
+    }
+}
+
+/* same for the timerfd, with &loop->tickfd as user_data */
+static void tick_queue(ev_loop *loop){
+    if(uring_read(loop->ring, loop->tickfd, &loop->tick_buf,
+                sizeof(loop->tick_buf), 0, &loop->tickfd) < 0){
+        unix_error("io_uring queue full");
+    }
+}
+
+static void uring_loop_run(ev_loop *loop){
+    struct io_uring_cqe *cqe;
+    conn *c;
+    int res;
+
+    wake_queue(loop);
+    tick_queue(loop);
+    while(1){
+        while(loop->accepts < EV_URING_ACCEPTS
+                && uring_accept(loop->ring, loop->listenfd, NULL) == 0){
+            loop->accepts++;
+        }
+        // one system call submits everything queued since the last one,
+        // and waits only if there is nothing left to run
+        if(uring_submit(loop->ring, loop->ready_head != NULL ? 0 : 1) < 0
+                && errno != EBUSY && errno != EAGAIN){
+            unix_error("io_uring_enter error");
+        }
+        while((cqe = uring_peek_cqe(loop->ring)) != NULL){
+            c = (conn *)(unsigned long)cqe->user_data;
+            res = cqe->res;
+            uring_cqe_seen(loop->ring);
+            if(c == (conn *)loop){
+                // the read on the eventfd: there is mail
+                mail_drain(loop);
+                wake_queue(loop);
+            }
+            else if(c == (conn *)&loop->tickfd){
+                idle_expire(loop);
+                tick_queue(loop);
+            }
+            else{
+                op_complete(loop, c, res);
+            }
+        }
+        run_ready(loop);
+    }
+}
+
+static void *loop_run(void *arg){
+    ev_loop *loop = (ev_loop *)arg;
+    struct epoll_event events[EV_MAX_EVENTS];
+    int i, n;
+
+    if(loop->shard >= 0){
+        shard_pin(loop->shard);
+    }
+    if(loop->ring != NULL){
+        uring_loop_run(loop);
+        return NULL;
+    }
+    while(1){
+        // don't sleep while completions are still queued
+        n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS,
+                loop->ready_head != NULL ? 0 : -1);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for(i = 0; i < n; i++){
+            if(events[i].data.ptr == NULL){
+                accept_clients(loop);
+            }
+            else if(events[i].data.ptr == loop){
+                if(read(loop->wakefd, &loop->wake_buf,
+                            sizeof(loop->wake_buf)) < 0 && errno != EAGAIN){
+                    unix_error("eventfd read error");
+                }
+                mail_drain(loop);
+            }
+            else if(events[i].data.ptr == &loop->tickfd){
+                if(read(loop->tickfd, &loop->tick_buf,
+                            sizeof(loop->tick_buf)) < 0 && errno != EAGAIN){
+                    unix_error("timerfd read error");
+                }
+                idle_expire(loop);
+            }
+            else{
+                op_try((conn *)events[i].data.ptr);
+            }
+        }
+        run_ready(loop);
+    }
+    return NULL;
+}
+
+void event_serve(int listenfd, int nloops, int use_uring){
+    struct epoll_event ev;
+    struct itimerspec tick;
+    struct rlimit rl;
+    pthread_t tid;
+    ev_loop *loop;
+    int i;
+
+    // each connection needs one or two descriptors
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    // with sharded listeners every loop owns one of them
+    if(shard_count() > 0){
+        nloops = shard_count();
+    }
+
+    for(i = 0; i < nloops; i++){
+        loop = (ev_loop *)Calloc(1, sizeof(ev_loop));
+        if(shard_count() > 0){
+            loop->shard = i;
+            loop->listenfd = shard_listenfd(i);
+            ev.events = EPOLLIN;
+        }
+        else{
+            loop->shard = -1;
+            loop->listenfd = listenfd;
+            // only one of the loops is woken per incoming connection
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        }
+        set_nonblock(loop->listenfd);
+        Sem_init(&loop->mail_mutex, 0, 1);
+        if(use_uring){
+            loop->ring = (uring_t *)Malloc(sizeof(uring_t));
+            if(uring_init(loop->ring, EV_URING_ENTRIES,
+                        EV_URING_CQ_ENTRIES) < 0){
+                fprintf(stderr, "io_uring not available, using epoll\n");
+                free(loop->ring);
+                loop->ring = NULL;
+                use_uring = 0;
+            }
+        }
+        // the ring waits for the eventfd's read itself, epoll needs it
+        // non-blocking to drain it; the same goes for the timerfd
+        if((loop->wakefd = eventfd(0, loop->ring != NULL ? 0
+                        : EFD_NONBLOCK)) < 0){
+            unix_error("eventfd error");
+        }
+        if((loop->tickfd = timerfd_create(CLOCK_MONOTONIC,
+                        loop->ring != NULL ? 0 : TFD_NONBLOCK)) < 0){
+            unix_error("timerfd_create error");
+        }
+        // idle connections are looked at once a second
+        memset(&tick, 0, sizeof(tick));
+        tick.it_value.tv_sec = tick.it_interval.tv_sec = 1;
+        if(timerfd_settime(loop->tickfd, 0, &tick, NULL) < 0){
+            unix_error("timerfd_settime error");
+        }
+        if(loop->ring == NULL){
+            if((loop->epfd = epoll_create1(0)) < 0){
+                unix_error("epoll_create1 error");
+            }
+            ev.data.ptr = NULL;
+            if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) < 0){
+                unix_error("epoll_ctl error");
+            }
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = loop;
+            if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0){
+                unix_error("epoll_ctl error");
+            }
+            ev.data.ptr = &loop->tickfd;
+            if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tickfd, &ev) < 0){
+                unix_error("epoll_ctl error");
+            }
+        }
+        if(i == nloops - 1){
+            loop_run(loop);
+        }
+        else{
+            Pthread_create(&tid, NULL, loop_run, loop);
+        }
+    }
+}
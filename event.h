@@ -0,0 +1,13 @@
+/*
+ * event.h - epoll based event loop front end
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/* serve connections from listenfd on nloops event loop threads, or one
+ * loop per listener shard if the shards were opened; the loops use
+ * io_uring instead of epoll if use_uring is set and the kernel has it
+ */
+void event_serve(int listenfd, int nloops, int use_uring);
+
+#endif /* __EVENT_H__ */
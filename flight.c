@@ -0,0 +1,179 @@
+/*
+ * flight.c - collapsed forwarding of concurrent misses
+ *
+ * When many clients ask for the same uncached URI at once, only the
+ * first one (the leader) goes to the origin. The others find its entry
+ * in the in-flight table and wait for it; once the leader has put the
+ * response in the cache they are served from there. If the leader fails
+ * or the response can't be cached, each follower fetches it itself. A
+ * leader whose own client goes away finishes the fetch anyway while
+ * anyone is waiting for it.
+ *
+ * Blocking front ends sleep on the flight's semaphore. Event loops can't
+ * sleep, so they park their connection with a callback instead.
+ */
+#include "csapp.h"
+#include "flight.h"
+
+#define FLIGHT_BUCKETS 1024
+
+typedef struct parked parked;
+struct parked{
+    void (*wake)(void *waiter, int ok);
+    void *waiter;
+    parked *next;
+};
+
+struct flight{
+    char *uri;
+    int done;                   // the leader has finished
+    int ok;                     // ... and its response is in the cache
+    int refcnt;                 // the table's and the followers'
+    int nfollowers;
+    int nsleeping;              // followers sleeping on wait
+    sem_t wait;
+    parked *parked;             // followers to call back
+    flight *next;               // next flight in the bucket
+};
+
+static flight *buckets[FLIGHT_BUCKETS];
+static sem_t flight_mutex;      // protects the table and the flights
+
+static unsigned long leaders, followers, fallbacks;
+
+static unsigned uri_hash(char *uri){
+    unsigned h = 2166136261u;
+
+    for(; *uri; uri++){
+        h = (h ^ (unsigned char)*uri) * 16777619u;
+    }
+    return h % FLIGHT_BUCKETS;
+}
+
+/* drop a reference; caller holds the mutex */
+static void flight_put(flight *f){
+    if(--f->refcnt == 0){
+        sem_destroy(&f->wait);
+        Free(f->uri);
+        Free(f);
+    }
+}
+
+void flight_init(void){
+    Sem_init(&flight_mutex, 0, 1);
+}
+
+flight *flight_join(char *uri, int *leader){
+    unsigned b = uri_hash(uri);
+    flight *f;
+
+    P(&flight_mutex);
+    for(f = buckets[b]; f != NULL; f = f->next){
+        if(strcmp(f->uri, uri) == 0){
+            f->refcnt++;
+            f->nfollowers++;
+            followers++;
+            V(&flight_mutex);
+            *leader = 0;
+            return f;
+        }
+    }
+    f = (flight *)Calloc(1, sizeof(flight));
+    f->uri = (char *)Malloc(strlen(uri) + 1);
+    strcpy(f->uri, uri);
+    f->refcnt = 1;
+    Sem_init(&f->wait, 0, 0);
+    f->next = buckets[b];
+    buckets[b] = f;
+    leaders++;
+    V(&flight_mutex);
+    *leader = 1;
+    return f;
+}
+
+int flight_wait(flight *f){
+    int ok;
+
+    P(&flight_mutex);
+    if(!f->done){
+        f->nsleeping++;
+        V(&flight_mutex);
+        P(&f->wait);
+        P(&flight_mutex);
+    }
+    ok = f->ok;
+    flight_put(f);
+    V(&flight_mutex);
+    return ok;
+}
+
+void flight_park(flight *f, void (*wake)(void *waiter, int ok),
+        void *waiter){
+    parked *p;
+    int ok;
+
+    P(&flight_mutex);
+    if(f->done){
+        ok = f->ok;
+        flight_put(f);
+        V(&flight_mutex);
+        wake(waiter, ok);
+        return;
+    }
+    // the parked entry keeps the follower's reference
+    p = (parked *)Malloc(sizeof(parked));
+    p->wake = wake;
+    p->waiter = waiter;
+    p->next = f->parked;
+    f->parked = p;
+    V(&flight_mutex);
+}
+
+int flight_waiting(flight *f){
+    int waiting;
+
+    P(&flight_mutex);
+    waiting = f->nfollowers > 0;
+    V(&flight_mutex);
+    return waiting;
+}
+
+void flight_done(flight *f, int ok){
+    flight **link;
+    parked *p, *list;
+    int i;
+
+    P(&flight_mutex);
+    for(link = &buckets[uri_hash(f->uri)]; *link != f; link = &(*link)->next){
+    }
+    *link = f->next;
+    f->done = 1;
+    f->ok = ok;
+    if(!ok){
+        fallbacks += f->nfollowers;
+    }
+    for(i = 0; i < f->nsleeping; i++){
+        V(&f->wait);
+    }
+    list = f->parked;
+    f->parked = NULL;
+    for(p = list; p != NULL; p = p->next){
+        f->refcnt--;
+    }
+    flight_put(f);
+    V(&flight_mutex);
+
+    while((p = list) != NULL){
+        list = p->next;
+        p->wake(p->waiter, ok);
+        Free(p);
+    }
+}
+
+void flight_report(FILE *fp){
+    P(&flight_mutex);
+    fprintf(fp, "collapsed forwarding: %lu fetches, %lu requests coalesced, "
+            "%lu fell back to their own fetch\n",
+            leaders, followers, fallbacks);
+    V(&flight_mutex);
+}
@@ -0,0 +1,34 @@
+/*
+ * flight.h - collapsed forwarding of concurrent misses
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+typedef struct flight flight;
+
+void flight_init(void);
+/* join the fetch of uri. *leader is set if nobody was fetching it yet:
+ * the caller fetches it and calls flight_done. Otherwise the caller is a
+ * follower and waits with flight_wait or flight_park.
+ */
+flight *flight_join(char *uri, int *leader);
+/* sleep until the leader is done; returns whether the response went
+ * into the cache
+ */
+int flight_wait(flight *f);
+/* call wake(waiter, ok) once the leader is done instead of sleeping;
+ * it runs on the thread calling flight_done, or right away if it is
+ * already done
+ */
+void flight_park(flight *f, void (*wake)(void *waiter, int ok),
+        void *waiter);
+/* whether anyone waits for the leader, so the fetch is worth finishing
+ * after its own client went away
+ */
+int flight_waiting(flight *f);
+/* the leader is done, ok if its response went into the cache */
+void flight_done(flight *f, int ok);
+/* print how many misses were collapsed */
+void flight_report(FILE *fp);
+
+#endif /* __FLIGHT_H__ */
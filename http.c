@@ -0,0 +1,532 @@
+/*
+ * http.c - HTTP/1.1 request parsing and message framing
+ *
+ * http_req_parse walks a request header block once, in place: scan.c
+ * marks the line ends and colons of each 64-byte block and the request
+ * line, URI and fields are left as offset/length slices of the buffer,
+ * so building the upstream request is a matter of copying them.
+ *
+ * Once the origin connections stay open, the end of a response can no
+ * longer be found by reading until EOF. http_resp follows a response's
+ * framing (Content-Length, chunked, or until close) as its bytes arrive,
+ * in whatever pieces the socket hands them over.
+ */
+#include "csapp.h"
+#include <strings.h>
+#include "http.h"
+#include "scan.h"
+
+/* does the header line of n bytes carry field name? */
+static int field_is(const char *line, size_t n, const char *name){
+    size_t len = strlen(name);
+    return n > len && line[len] == ':' && strncasecmp(line, name, len) == 0;
+}
+
+/* does the value of n bytes contain tok, ignoring case? */
+static int value_has(const char *v, size_t n, const char *tok){
+    size_t len = strlen(tok), i;
+
+    for(i = 0; i + len <= n; i++){
+        if(strncasecmp(v + i, tok, len) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_space(char c){
+    return c == ' ' || c == '\t';
+}
+
+/* take the next space-delimited token of [*p, end) into s */
+static void next_token(const char *buf, const char **p, const char *end,
+        http_slice *s){
+    const char *q;
+
+    while(*p < end && is_space(**p)){
+        (*p)++;
+    }
+    q = *p + scan_space(*p, end - *p);
+    s->off = *p - buf;
+    s->len = q - *p;
+    *p = q;
+}
+
+/* does the slice hold str, ignoring case? */
+static int slice_is(const char *buf, http_slice *s, const char *str){
+    return s->len == strlen(str) && strncasecmp(buf + s->off, str, s->len) == 0;
+}
+
+/* split an absolute-form URI into host, port and path */
+static int parse_uri(http_req *r, const char *buf){
+    const char *p = buf + r->uri.off, *end = p + r->uri.len, *q;
+
+    // skip the scheme
+    for(q = p; q + 1 < end && (q[0] != '/' || q[1] != '/'); q++){
+    }
+    if(q + 1 >= end){
+        return -1;
+    }
+    for(p = q += 2; q < end && *q != ':' && *q != '/' && *q != '?'; q++){
+    }
+    r->host.off = p - buf;
+    r->host.len = q - p;
+    r->port.off = q - buf;
+    r->port.len = 0;
+    if(q < end && *q == ':'){
+        for(p = ++q; q < end && *q >= '0' && *q <= '9'; q++){
+        }
+        r->port.off = p - buf;
+        r->port.len = q - p;
+    }
+    if(r->host.len == 0 || (q < end && *q != '/' && *q != '?')){
+        return -1;
+    }
+    r->path.off = q - buf;
+    r->path.len = end - q;
+    return 0;
+}
+
+/* header names the proxy handles itself, as scan_word wants them */
+static const char field_names[][SCAN_WORD] = {
+    [HF_HOST] = "host",
+    [HF_USER_AGENT] = "user-agent",
+    [HF_CONNECTION] = "connection",
+    [HF_PROXY_CONNECTION] = "proxy-connection",
+    [HF_KEEP_ALIVE] = "keep-alive"
+};
+
+/* avail is how many bytes may be read at name */
+static int field_kind(const char *name, size_t n, size_t avail){
+    switch(n){
+    case 4:
+        return scan_word(name, n, avail, field_names[HF_HOST]) ?
+            HF_HOST : HF_OTHER;
+    case 10:
+        if(scan_word(name, n, avail, field_names[HF_USER_AGENT])){
+            return HF_USER_AGENT;
+        }
+        if(scan_word(name, n, avail, field_names[HF_CONNECTION])){
+            return HF_CONNECTION;
+        }
+        if(scan_word(name, n, avail, field_names[HF_KEEP_ALIVE])){
+            return HF_KEEP_ALIVE;
+        }
+        return HF_OTHER;
+    case 16:
+        return scan_word(name, n, avail, field_names[HF_PROXY_CONNECTION]) ?
+            HF_PROXY_CONNECTION : HF_OTHER;
+    default:
+        return HF_OTHER;
+    }
+}
+
+/* take the line [line, eol) of the header block in the len bytes at buf;
+ * colon is its first ':', or NULL. Returns the header length once the
+ * empty line is reached, 0 to go on, HTTP_TOO_LARGE if there is no room
+ * for the field, or -1 if the line is malformed.
+ */
+static int req_line(http_req *r, const char *buf, size_t len,
+        const char *line, const char *eol, const char *colon){
+    const char *eos = eol > line && eol[-1] == '\r' ? eol - 1 : eol, *p;
+    http_field *f;
+
+    if(line == buf){
+        // request line: method URI [version]
+        p = line;
+        next_token(buf, &p, eos, &r->method);
+        next_token(buf, &p, eos, &r->uri);
+        next_token(buf, &p, eos, &r->version);
+        while(p < eos && is_space(*p)){
+            p++;
+        }
+        if(r->method.len == 0 || r->uri.len == 0 || p != eos
+                || parse_uri(r, buf) < 0){
+            return -1;
+        }
+        // HTTP/1.1 connections persist unless the client says close
+        r->keep_alive = r->version.len > 0
+            && !slice_is(buf, &r->version, "HTTP/1.0");
+        return 0;
+    }
+    if(eos == line){
+        return eol + 1 - buf;
+    }
+    if(colon == NULL || colon == line || is_space(colon[-1])){
+        return -1;
+    }
+    if(r->nfields == HTTP_MAX_FIELDS){
+        return HTTP_TOO_LARGE;
+    }
+    f = &r->fields[r->nfields];
+    f->name.off = line - buf;
+    f->name.len = colon - line;
+    for(p = colon + 1; p < eos && is_space(*p); p++){
+    }
+    f->value.off = p - buf;
+    for(p = eos; p > buf + f->value.off && is_space(p[-1]); p--){
+    }
+    f->value.len = p - (buf + f->value.off);
+    f->kind = field_kind(line, f->name.len, len - f->name.off);
+    if(f->kind == HF_HOST && r->host_field < 0){
+        r->host_field = r->nfields;
+    }
+    else if(f->kind == HF_CONNECTION || f->kind == HF_PROXY_CONNECTION){
+        if(value_has(buf + f->value.off, f->value.len, "close")){
+            r->keep_alive = 0;
+        }
+        else if(value_has(buf + f->value.off, f->value.len, "keep-alive")){
+            r->keep_alive = 1;
+        }
+    }
+    r->nfields++;
+    return 0;
+}
+
+int http_req_parse(http_req *r, const char *buf, size_t len){
+    const char *line = buf, *colon = NULL, *eol;
+    uint64_t nl, co, bit;
+    size_t base;
+    int rc;
+
+    r->nfields = 0;
+    r->host_field = -1;
+    for(base = 0; base < len; base += SCAN_BLOCK){
+        scan_block(buf + base, len - base, &nl, &co);
+        while(nl != 0){
+            // the lowest '\n' ends the line; colons below it are in it
+            bit = nl & -nl;
+            if(colon == NULL && (co & (bit - 1)) != 0){
+                colon = buf + base + __builtin_ctzll(co & (bit - 1));
+            }
+            co &= ~(bit | (bit - 1));
+            nl ^= bit;
+            eol = buf + base + __builtin_ctzll(bit);
+            if((rc = req_line(r, buf, len, line, eol, colon)) != 0){
+                return rc;
+            }
+            line = eol + 1;
+            colon = NULL;
+        }
+        if(colon == NULL && co != 0){
+            colon = buf + base + __builtin_ctzll(co);
+        }
+    }
+    return 0;
+}
+
+void http_resp_init(http_resp *r){
+    r->state = HR_HEADER;
+    r->status = 0;
+    r->keep_alive = 0;
+    r->chunked = 0;
+    r->content_length = -1;
+    r->remaining = 0;
+    r->chunk_size = 0;
+    r->header_len = 0;
+}
+
+static int header_field(http_resp *r, const char *line, size_t n){
+    const char *v = (const char *)memchr(line, ':', n) + 1;
+    size_t vlen = line + n - v;
+    long long cl = 0;
+
+    while(vlen > 0 && (*v == ' ' || *v == '\t')){
+        v++;
+        vlen--;
+    }
+    if(field_is(line, n, "Content-Length")){
+        if(vlen == 0){
+            return -1;
+        }
+        for(; vlen > 0 && *v >= '0' && *v <= '9'; v++, vlen--){
+            if(cl > (1LL << 53)){
+                return -1;
+            }
+            cl = cl * 10 + (*v - '0');
+        }
+        if(vlen > 0 && *v != ' ' && *v != '\t'){
+            return -1;
+        }
+        r->content_length = cl;
+    }
+    else if(field_is(line, n, "Transfer-Encoding")){
+        r->chunked = value_has(v, vlen, "chunked");
+    }
+    else if(field_is(line, n, "Connection")){
+        if(value_has(v, vlen, "close")){
+            r->keep_alive = 0;
+        }
+        else if(value_has(v, vlen, "keep-alive")){
+            r->keep_alive = 1;
+        }
+    }
+    return 0;
+}
+
+/* pick the body framing once the header block is in */
+static void header_done(http_resp *r){
+    if(r->status / 100 == 1){
+        // interim responses aren't expected for a GET; don't reuse
+        r->keep_alive = 0;
+        r->state = HR_BODY_CLOSE;
+    }
+    else if(r->status == 204 || r->status == 304){
+        r->state = HR_DONE;
+    }
+    else if(r->chunked){
+        r->chunk_size = 0;
+        r->state = HR_CHUNK_SIZE;
+    }
+    else if(r->content_length >= 0){
+        r->remaining = r->content_length;
+        r->state = r->remaining > 0 ? HR_BODY_LENGTH : HR_DONE;
+    }
+    else{
+        r->keep_alive = 0;
+        r->state = HR_BODY_CLOSE;
+    }
+}
+
+int http_resp_header(http_resp *r, const char *buf, size_t len){
+    const char *line = buf, *end = buf + len, *eol;
+    size_t n;
+
+    while(line < end){
+        if((eol = memchr(line, '\n', end - line)) == NULL){
+            return 0;
+        }
+        n = eol - line;
+        if(n > 0 && line[n - 1] == '\r'){
+            n--;
+        }
+        if(line == buf){
+            // status line: HTTP/1.x SSS reason
+            if(n < 12 || strncmp(line, "HTTP/1.", 7) != 0
+                    || !isdigit((unsigned char)line[7]) || line[8] != ' '
+                    || !isdigit((unsigned char)line[9])
+                    || !isdigit((unsigned char)line[10])
+                    || !isdigit((unsigned char)line[11])){
+                r->state = HR_ERROR;
+                return -1;
+            }
+            r->status = (line[9] - '0') * 100 + (line[10] - '0') * 10
+                + (line[11] - '0');
+            // HTTP/1.1 connections persist unless told otherwise
+            r->keep_alive = line[7] != '0';
+        }
+        else if(n == 0){
+            header_done(r);
+            r->header_len = eol + 1 - buf;
+            return r->header_len;
+        }
+        else if(memchr(line, ':', n) == NULL || header_field(r, line, n) < 0){
+            r->state = HR_ERROR;
+            return -1;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+static int hex_value(char c){
+    if(c >= '0' && c <= '9'){
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f'){
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F'){
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* consume body bytes; returns how many of them belong to the response */
+static size_t http_resp_body(http_resp *r, const char *buf, size_t len){
+    size_t i = 0, take;
+    int v;
+    char c;
+
+    while(i < len && r->state != HR_DONE && r->state != HR_ERROR){
+        switch(r->state){
+        case HR_BODY_CLOSE:
+            return len;
+        case HR_BODY_LENGTH:
+        case HR_CHUNK_DATA:
+            take = len - i;
+            if((long long)take > r->remaining){
+                take = r->remaining;
+            }
+            i += take;
+            r->remaining -= take;
+            if(r->remaining == 0){
+                r->state = r->state == HR_BODY_LENGTH ? HR_DONE
+                    : HR_CHUNK_DATA_END;
+            }
+            break;
+        case HR_CHUNK_SIZE:
+        case HR_CHUNK_EXT:
+            c = buf[i++];
+            if(c == '\n'){
+                // end of the chunk-size line
+                if(r->chunk_size == 0){
+                    r->state = HR_TRAILER_START;
+                }
+                else{
+                    r->remaining = r->chunk_size;
+                    r->chunk_size = 0;
+                    r->state = HR_CHUNK_DATA;
+                }
+            }
+            else if(r->state == HR_CHUNK_EXT || c == '\r'){
+                // skip extensions and the CR
+            }
+            else if((v = hex_value(c)) >= 0){
+                if(r->chunk_size > (1LL << 53)){
+                    r->state = HR_ERROR;
+                }
+                r->chunk_size = r->chunk_size * 16 + v;
+            }
+            else if(c == ';' || c == ' ' || c == '\t'){
+                r->state = HR_CHUNK_EXT;
+            }
+            else{
+                r->state = HR_ERROR;
+            }
+            break;
+        case HR_CHUNK_DATA_END:
+            c = buf[i++];
+            if(c == '\n'){
+                r->state = HR_CHUNK_SIZE;
+            }
+            else if(c != '\r'){
+                r->state = HR_ERROR;
+            }
+            break;
+        case HR_TRAILER_START:
+            c = buf[i++];
+            if(c == '\n'){
+                r->state = HR_DONE;
+            }
+            else if(c != '\r'){
+                r->state = HR_TRAILER_LINE;
+            }
+            break;
+        case HR_TRAILER_LINE:
+            if(buf[i++] == '\n'){
+                r->state = HR_TRAILER_START;
+            }
+            break;
+        default:
+            // the header block hasn't been parsed
+            return i;
+        }
+    }
+    return i;
+}
+
+size_t http_resp_feed(http_resp *r, const char *start, size_t off, size_t n){
+    int hdr_len;
+
+    switch(r->state){
+    case HR_HEADER:
+        if((hdr_len = http_resp_header(r, start, off + n)) == 0){
+            return n;
+        }
+        if(hdr_len < 0){
+            // can't follow this framing, pass it on until the origin closes
+            r->keep_alive = 0;
+            r->state = HR_ERROR;
+            return n;
+        }
+        return (hdr_len - off)
+            + http_resp_body(r, start + hdr_len, off + n - hdr_len);
+    case HR_BODY_CLOSE:
+    case HR_ERROR:
+        return n;
+    default:
+        return http_resp_body(r, start + off, n);
+    }
+}
+
+long long http_resp_opaque(http_resp *r){
+    switch(r->state){
+    case HR_BODY_LENGTH:
+        return r->remaining;
+    case HR_BODY_CLOSE:
+    case HR_ERROR:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+void http_resp_skip(http_resp *r, size_t n){
+    if(r->state == HR_BODY_LENGTH){
+        r->remaining -= n;
+        if(r->remaining <= 0){
+            r->state = HR_DONE;
+        }
+    }
+}
+
+int http_resp_eof(http_resp *r){
+    if(r->state == HR_BODY_CLOSE){
+        r->state = HR_DONE;
+    }
+    return r->state == HR_DONE;
+}
+
+int http_resp_framed(http_resp *r){
+    return r->state != HR_HEADER && r->state != HR_BODY_CLOSE
+        && r->state != HR_ERROR;
+}
+
+size_t http_resp_strip(http_resp *r, char *buf, size_t len){
+    char *line, *eol, *end = buf + r->header_len;
+    size_t n, cut;
+
+    // the status line stays
+    if((line = memchr(buf, '\n', r->header_len)) == NULL){
+        return len;
+    }
+    for(line++; line < end; ){
+        eol = memchr(line, '\n', end - line);
+        n = eol - line;
+        if(n > 0 && line[n - 1] == '\r'){
+            n--;
+        }
+        if(field_is(line, n, "Connection")
+                || field_is(line, n, "Proxy-Connection")
+                || field_is(line, n, "Keep-Alive")){
+            cut = eol + 1 - line;
+            memmove(line, eol + 1, buf + len - (eol + 1));
+            len -= cut;
+            end -= cut;
+            r->header_len -= cut;
+        }
+        else{
+            line = eol + 1;
+        }
+    }
+    return len;
+}
+
+int http_conn_iov(struct iovec *iov, char *buf, size_t len, int keep_alive){
+    static char conn_keep[] = "Connection: keep-alive\r\n";
+    static char conn_close[] = "Connection: close\r\n";
+    char *eol;
+    size_t status_len;
+
+    // a parsed header block always has its status line
+    eol = memchr(buf, '\n', len);
+    status_len = eol != NULL ? (size_t)(eol + 1 - buf) : len;
+    iov[0].iov_base = buf;
+    iov[0].iov_len = status_len;
+    iov[1].iov_base = keep_alive ? conn_keep : conn_close;
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = buf + status_len;
+    iov[2].iov_len = len - status_len;
+    return 3;
+}
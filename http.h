@@ -0,0 +1,116 @@
+/*
+ * http.h - HTTP/1.1 request parsing and message framing
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/uio.h>
+
+#define HTTP_MAX_FIELDS 100     // header fields taken per request
+#define HTTP_TOO_LARGE (-2)     // a request's header fields don't fit
+
+/* a piece of the buffer a request was parsed from */
+typedef struct {
+    size_t off;
+    size_t len;
+} http_slice;
+
+/* header fields the proxy handles itself */
+enum {
+    HF_OTHER,
+    HF_HOST,
+    HF_USER_AGENT,
+    HF_CONNECTION,
+    HF_PROXY_CONNECTION,
+    HF_KEEP_ALIVE
+};
+
+typedef struct {
+    int kind;                   // HF_*
+    http_slice name;
+    http_slice value;           // without the whitespace around it
+} http_field;
+
+typedef struct {
+    http_slice method;
+    http_slice uri;             // as the client sent it
+    http_slice host;            // from the absolute-form URI
+    http_slice port;            // empty if the URI has none
+    http_slice path;            // path and query, may be empty
+    http_slice version;         // empty if the request line has none
+    int keep_alive;             // the client wants the connection kept open
+    int host_field;             // index of the Host field, or -1
+    int nfields;
+    http_field fields[HTTP_MAX_FIELDS];
+} http_req;
+
+/* parse the request header block at the start of the len bytes in buf in
+ * one pass, leaving slices of it in r; returns its length, 0 if it is
+ * not complete yet, HTTP_TOO_LARGE if it has more than HTTP_MAX_FIELDS
+ * fields, or -1 if it is malformed
+ */
+int http_req_parse(http_req *r, const char *buf, size_t len);
+
+/* Where a response is in its framing */
+enum {
+    HR_HEADER,                  // waiting for the header block
+    HR_BODY_LENGTH,             // Content-Length bytes left in remaining
+    HR_BODY_CLOSE,              // body runs until the origin closes
+    HR_CHUNK_SIZE,              // chunked: reading a chunk-size line
+    HR_CHUNK_EXT,               // chunked: skipping chunk extensions
+    HR_CHUNK_DATA,              // chunked: remaining bytes of chunk data
+    HR_CHUNK_DATA_END,          // chunked: CRLF after chunk data
+    HR_TRAILER_START,           // chunked: start of a trailer line
+    HR_TRAILER_LINE,            // chunked: inside a trailer line
+    HR_DONE,                    // the whole response has been seen
+    HR_ERROR                    // malformed, runs until the origin closes
+};
+
+typedef struct {
+    int state;
+    int status;                 // status code
+    int keep_alive;             // the connection can carry another request
+    int chunked;                // Transfer-Encoding: chunked
+    long long content_length;   // -1 if not given
+    long long remaining;        // bytes left of the body or current chunk
+    long long chunk_size;       // chunk size being parsed
+    size_t header_len;          // length of the header block once parsed
+} http_resp;
+
+void http_resp_init(http_resp *r);
+/* parse the response header block at the start of buf; returns its
+ * length, 0 if it is not complete yet, or -1 if it is malformed
+ */
+int http_resp_header(http_resp *r, const char *buf, size_t len);
+/* feed the n bytes just received at start + off, where start holds the
+ * response from its first byte at least until the header block has been
+ * parsed; returns how many of the n bytes belong to the response.
+ * r->state becomes HR_DONE once its end has been seen.
+ */
+size_t http_resp_feed(http_resp *r, const char *start, size_t off, size_t n);
+/* how many more body bytes may go by without being fed, e.g. spliced
+ * straight to the client: -1 if the body runs until close, 0 if the
+ * framing has to see them
+ */
+long long http_resp_opaque(http_resp *r);
+/* n body bytes went by without being fed */
+void http_resp_skip(http_resp *r, size_t n);
+/* the origin closed the connection; returns whether that ended the
+ * response cleanly
+ */
+int http_resp_eof(http_resp *r);
+/* can the client find the end of the body without the connection being
+ * closed? Asked once the header block has been parsed.
+ */
+int http_resp_framed(http_resp *r);
+/* remove the hop-by-hop Connection, Proxy-Connection and Keep-Alive
+ * fields from the parsed header block at the start of the len bytes in
+ * buf; returns how many bytes are left
+ */
+size_t http_resp_strip(http_resp *r, char *buf, size_t len);
+/* point iov at the len bytes of a response, with our own Connection
+ * field after the status line; returns the number of iovecs used
+ */
+int http_conn_iov(struct iovec *iov, char *buf, size_t len, int keep_alive);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,156 @@
+/*
+ * pool.c - prethreaded worker pool
+ *
+ * The accept loop hands connections to a fixed set of worker threads
+ * through a bounded buffer, the sbuf of CS:APP 12.5.4. When the buffer
+ * is full the accept loop stops accepting, so a connection storm backs up
+ * in the kernel's listen queue instead of in our memory.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "pool.h"
+#include "shard.h"
+
+typedef struct {
+    client_info client;
+    struct timespec queued;     // when the accept loop inserted it
+} sbuf_item;
+
+typedef struct {
+    sbuf_item *buf;             // circular buffer of connections
+    int n;                      // maximum number of slots
+    int front;                  // buf[front] is the first item
+    int rear;                   // buf[rear] is the next free slot
+    int cnt;                    // number of queued connections
+    sem_t mutex;                // protects buf, front, rear and the stats
+    sem_t slots;                // counts available slots
+    sem_t items;                // counts available items
+    unsigned long served;       // connections taken by workers
+    long long wait_total;       // microseconds they spent queued
+    long long wait_max;
+} sbuf_t;
+
+static sbuf_t sbuf;
+static int pool_workers;
+static int pool_listenfd;
+
+static void sbuf_init(sbuf_t *sp, int n){
+    sp->buf = (sbuf_item *)Calloc(n, sizeof(sbuf_item));
+    sp->n = n;
+    sp->front = sp->rear = sp->cnt = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+    sp->served = 0;
+    sp->wait_total = sp->wait_max = 0;
+}
+
+/* insert into a slot the caller already reserved with P(&sp->slots) */
+static void sbuf_insert(sbuf_t *sp, client_info *client){
+    P(&sp->mutex);
+    sp->buf[sp->rear].client = *client;
+    clock_gettime(CLOCK_MONOTONIC, &sp->buf[sp->rear].queued);
+    sp->rear = (sp->rear + 1) % sp->n;
+    sp->cnt++;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+static void sbuf_remove(sbuf_t *sp, client_info *client){
+    struct timespec now;
+    long long wait;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    *client = sp->buf[sp->front].client;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wait = (now.tv_sec - sp->buf[sp->front].queued.tv_sec) * 1000000LL
+        + (now.tv_nsec - sp->buf[sp->front].queued.tv_nsec) / 1000;
+    sp->front = (sp->front + 1) % sp->n;
+    sp->cnt--;
+    sp->served++;
+    sp->wait_total += wait;
+    if(wait > sp->wait_max){
+        sp->wait_max = wait;
+    }
+    V(&sp->mutex);
+    V(&sp->slots);
+}
+
+static void *pool_worker(void *arg){
+    client_info client;
+    arena *a;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+    // one arena for every connection the worker serves
+    if((a = arena_get()) == NULL){
+        app_error("no memory for a worker arena");
+    }
+    while(1){
+        sbuf_remove(&sbuf, &client);
+        client.arena = a;
+        serve_client(&client);
+    }
+    return NULL;
+}
+
+/* accept loop for listener shard (long)arg, or the shared listener */
+static void *pool_acceptor(void *arg){
+    int shard = (int)(long)arg;
+    int listenfd = shard >= 0 ? shard_listenfd(shard) : pool_listenfd;
+    client_info client;
+
+    if(shard >= 0){
+        shard_pin(shard);
+    }
+    while(1){
+        // wait for a free slot before taking the next connection
+        P(&sbuf.slots);
+        client.addrlen = sizeof(client.addr);
+        client.connfd = Accept(listenfd, (SA *)&client.addr, &client.addrlen);
+        if(shard >= 0){
+            shard_accepted(shard);
+        }
+        sbuf_insert(&sbuf, &client);
+    }
+    return NULL;
+}
+
+void pool_serve(int listenfd, int nworkers, int depth){
+    pthread_t tid;
+    int i;
+
+    sbuf_init(&sbuf, depth);
+    pool_workers = nworkers;
+    pool_listenfd = listenfd;
+    for(i = 0; i < nworkers; i++){
+        Pthread_create(&tid, NULL, pool_worker, NULL);
+    }
+
+    // one accept loop per listener shard, all feeding the same buffer
+    for(i = 1; i < shard_count(); i++){
+        Pthread_create(&tid, NULL, pool_acceptor, (void *)(long)i);
+    }
+    pool_acceptor((void *)(long)(shard_count() > 0 ? 0 : -1));
+}
+
+void pool_report(FILE *fp){
+    unsigned long served;
+    long long wait_total, wait_max;
+    int queued;
+
+    if(sbuf.buf == NULL){
+        return;
+    }
+    P(&sbuf.mutex);
+    served = sbuf.served;
+    wait_total = sbuf.wait_total;
+    wait_max = sbuf.wait_max;
+    queued = sbuf.cnt;
+    V(&sbuf.mutex);
+    fprintf(fp, "pool: %d workers, %d/%d queued, %lu served, "
+            "queue wait avg %.3f ms max %.3f ms\n",
+            pool_workers, queued, sbuf.n, served,
+            served ? wait_total / 1000.0 / served : 0.0, wait_max / 1000.0);
+}
@@ -0,0 +1,18 @@
+/*
+ * pool.h - prethreaded worker pool front end
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#define POOL_DEFAULT_WORKERS 32
+#define POOL_DEFAULT_DEPTH 256
+
+/* accept connections from listenfd, or from every listener shard if
+ * the shards were opened, and hand them to nworkers threads through a
+ * queue of at most depth connections; never returns
+ */
+void pool_serve(int listenfd, int nworkers, int depth);
+/* print queue statistics */
+void pool_report(FILE *fp);
+
+#endif /* __POOL_H__ */
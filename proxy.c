@@ -1,358 +1,815 @@
+#define _GNU_SOURCE             /* for splice */
 #include "csapp.h"
 #include <pthread.h>
+#include <sys/sendfile.h>
 #include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "pool.h"
+#include "shard.h"
+#include "http.h"
+#include "upstream.h"
+#include "dns.h"
+#include "flight.h"
+#include "scan.h"
+#include "slab.h"
+#include "disk.h"
 
+enum { MODE_THREAD, MODE_POOL, MODE_EVENT };
 
+int relay_splice = 1;
+int client_idle = CLIENT_DEFAULT_IDLE;
+int client_max_requests = CLIENT_DEFAULT_MAX_REQUESTS;
+int client_max_header = CLIENT_DEFAULT_MAX_HEADER;
+size_t cache_max_object = CACHE_DEFAULT_MAX_OBJECT;
+
+const char header_too_large[] = "HTTP/1.1 431 Request Header Fields Too Large"
+                                "\r\nConnection: close"
+                                "\r\nContent-Length: 0\r\n\r\n";
+const char header_bad_request[] = "HTTP/1.1 400 Bad Request"
+                                  "\r\nConnection: close"
+                                  "\r\nContent-Length: 0\r\n\r\n";
 
-#define MAX_OBJECT_SIZE 102400
-#define MAX_TOKEN_NUM 4
-#define MAX_TOKEN_LEN 100
-#define PORT_CHAR_NUM 6
-#define HOST_CHAR_NUM 50
-#define REST_CHAR_NUM 200
-#define HOSTLEN 256
-#define SERVLEN 8
-#define MAX_RESPONSE_SIZE 512000
-#define DEBUG 0
 
 static const char *header_user_agent = "Mozilla/5.0"
                                     " (X11; Linux x86_64; rv:45.0)"
                                     " Gecko/20100101 Firefox/45.0";
 
 
-static const char *request_method_get = "GET";
-static const char *request_protocol = "HTTP/1.0";
-static const char *header_host_key = "Host:";
-static const char *header_ua_key = "User-Agent:";
-static const char *header_conn_key = "Connection:";
-static const char *header_conn_value = "close";
-static const char *header_proxconn_key = "Proxy-Connection:";
-// Information about a connected client.
+static const char *request_protocol = "HTTP/1.1";
+static const char *header_conn_close = "close";
+static const char *header_conn_keep = "keep-alive";
+
+/* the request being built for the origin, in cap bytes of an arena */
 typedef struct {
-    struct sockaddr_in addr;    // Socket address
-    socklen_t addrlen;          // Socket address length
-    int connfd;                 // Client connection file descriptor
-    char host[HOSTLEN];         // Client host
-    char serv[SERVLEN];         // Client service (port)
-} client_info;
-
-/* return -1 on single token length > maxTokenLen
- * return -2 on number of tokens > maxTokens
+    char *buf;
+    size_t len;
+    size_t cap;
+} out_buf;
+
+/* append n bytes to the request being built; returns -1 if they don't
+ * fit
  */
 
-int tokenize(char *buf, int maxTokens, int maxTokenLen, char tokens[maxTokens][maxTokenLen]){
+static int put(out_buf *out, const char *s, size_t n){
+    if(out->len + n > out->cap){
+        return -1;
+    }
+    memcpy(out->buf + out->len, s, n);
+    out->len += n;
+    return 0;
+}
+
+static int put_str(out_buf *out, const char *s){
+    return put(out, s, strlen(s));
+}
 
-    int i, curInd = 0, writeInd;
-    for(i = 0; i <= maxTokens; i++){
-        if(buf[curInd] == '\n' || buf[curInd] == '\r'){
-            break;
+static int put_slice(out_buf *out, const char *buf, http_slice *s){
+    return put(out, buf + s->off, s->len);
+}
+
+/* copy a slice into a NUL-terminated string carved out of a, or into
+ * def if the slice is empty; NULL if there is no room
+ */
+
+static char *slice_dup(arena *a, const char *buf, http_slice *s,
+        const char *def){
+    size_t n = s->len > 0 ? s->len : strlen(def);
+    char *p;
+
+    if((p = (char *)arena_alloc(a, n + 1)) != NULL){
+        memcpy(p, s->len > 0 ? buf + s->off : def, n);
+        p[n] = 0;
+    }
+    return p;
+}
+
+/* rewrite the request http_req_parse found in req into the request to
+ * forward: request line, Host, our own User-Agent and Connection fields,
+ * then the client's other fields, copied slice by slice in one pass.
+ * The request and the host, port and uri strings are carved out of a.
+ * Returns its length, -1 if the request can't be forwarded, or
+ * HTTP_TOO_LARGE if it doesn't fit.
+ */
+
+int rewrite_request(http_req *r, const char *req, arena *a,
+        char **forward_buf, char **host, char **port, char **uri){
+
+    out_buf out;
+    int i, rc = 0;
+    http_field *f;
+    // ask the origin to keep the connection open if we can pool it
+    const char *header_conn_value = upstream_enabled() ?
+        header_conn_keep : header_conn_close;
+
+    if(r->method.len != 3 || memcmp(req + r->method.off, "GET", 3) != 0){
+        fprintf(stderr, "Currently only support GET method, received %.*s\n",
+                (int)r->method.len, req + r->method.off);
+        return -1;
+    }
+
+    // build it in what is left of the arena, then keep what was used
+    out.buf = (char *)arena_alloc_rest(a, &out.cap);
+    out.len = 0;
+    rc |= put(&out, "GET ", 4);
+    if(r->path.len == 0 || req[r->path.off] != '/'){
+        rc |= put(&out, "/", 1);
+    }
+    rc |= put_slice(&out, req, &r->path);
+    rc |= put(&out, " ", 1);
+    rc |= put_str(&out, request_protocol);
+    if(r->host_field >= 0){
+        // keep the client's Host field
+        f = &r->fields[r->host_field];
+        rc |= put(&out, "\r\nHost: ", 8);
+        rc |= put_slice(&out, req, &f->value);
+    }
+    else{
+        rc |= put(&out, "\r\nHost: ", 8);
+        rc |= put_slice(&out, req, &r->host);
+        if(r->port.len > 0){
+            rc |= put(&out, ":", 1);
+            rc |= put_slice(&out, req, &r->port);
         }
-        if(i == maxTokens){
-            // if reaches here, the tokens contained is more than madTokens
-            return -2;
+    }
+    rc |= put(&out, "\r\nUser-Agent: ", 14);
+    rc |= put_str(&out, header_user_agent);
+    rc |= put(&out, "\r\nConnection: ", 14);
+    rc |= put_str(&out, header_conn_value);
+    rc |= put(&out, "\r\nProxy-Connection: ", 20);
+    rc |= put_str(&out, header_conn_value);
+    rc |= put(&out, "\r\n", 2);
+    for(i = 0; i < r->nfields; i++){
+        f = &r->fields[i];
+        if(f->kind != HF_OTHER){
+            // hop-by-hop, or replaced by ours
+            continue;
+        }
+        // name: value, as the client wrote it
+        rc |= put(&out, req + f->name.off,
+                f->value.off + f->value.len - f->name.off);
+        rc |= put(&out, "\r\n", 2);
+    }
+    rc |= put(&out, "\r\n", 2);
+    arena_trim(a, out.buf, out.len);
+    // if the port not specified, use 80
+    if(rc < 0 || (*uri = slice_dup(a, req, &r->uri, "")) == NULL
+            || (*host = slice_dup(a, req, &r->host, "")) == NULL
+            || (*port = slice_dup(a, req, &r->port, "80")) == NULL){
+        fprintf(stderr, "request too long to forward\n");
+        return HTTP_TOO_LARGE;
+    }
+    *forward_buf = out.buf;
+    return out.len;
+}
+
+/* the buffers of a request in the blocking modes, carved out of the
+ * connection's arena along with the relay buffer and response copy of a
+ * fetch; serve_client takes them all back once the request is served
+ */
+typedef struct {
+    char *req;                  // request header block as read, -H bytes
+    http_req r;
+    char *forward_buf;          // and the rest, from rewrite_request
+    char *host;
+    char *port;
+    char *uri;
+} req_bufs;
+
+/* read the next request header block from the client and rewrite it
+ * into b->forward_buf; returns 0 if the client closed the connection or
+ * went idle before sending one
+ */
+
+int validate_replace(rio_t *rio, arena *a, req_bufs *b, int *keep_alive){
+
+    ssize_t len;
+    size_t req_len = 0, line = 0, max = client_max_header;
+    char *req = b->req, *piece;
+    int rc;
+
+    // gather the lines rio finds in its buffer into req, long ones in
+    // pieces, up to the empty line
+    while(req_len < max
+            && (len = rio_getlineb(rio, &piece, max - req_len)) > 0){
+        memcpy(req + req_len, piece, len);
+        req_len += len;
+        if(piece[len - 1] != '\n'){
+            continue;
         }
-        while(buf[curInd] == '\t' || buf[curInd] == ' '){
-            curInd++;
+        if(req_len - line == 1 || (req_len - line == 2 && req[line] == '\r')){
+            break;
         }
-        writeInd = 0;
-        while(buf[curInd] != '\t' && buf[curInd] != ' ' 
-            && buf[curInd] != '\r' && buf[curInd] != '\n' 
-            && writeInd < maxTokenLen - 1){
-            tokens[i][writeInd++] = buf[curInd++];
-        } 
-        if(writeInd == maxTokenLen - 1){
+        line = req_len;
+    }
+    if(req_len == 0){
+        return 0;
+    }
+    if((rc = http_req_parse(&b->r, req, req_len)) == 0 && req_len == max){
+        fprintf(stderr, "request header too large\n");
+        return HTTP_TOO_LARGE;
+    }
+    if(rc <= 0){
+        fprintf(stderr, rc == HTTP_TOO_LARGE ? "too many header fields\n"
+                : "received malformed or unfinished http request\n");
+        return rc < 0 ? rc : -1;
+    }
+    *keep_alive = b->r.keep_alive;
+
+    return rewrite_request(&b->r, req, a, &b->forward_buf,
+            &b->host, &b->port, &b->uri);
+}
+
+/* write all of iov to fd; returns the bytes written, or -1 on error */
+
+ssize_t writev_full(int fd, struct iovec *iov, int iovcnt){
+    ssize_t n, total = 0;
+
+    while(iovcnt > 0){
+        if((n = writev(fd, iov, iovcnt)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
             return -1;
         }
-        // NULL terminate
-        tokens[i][writeInd] = 0;
-    }   
-    return i;
+        total += n;
+        // skip what went out
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
 }
 
-/* return -1: host too long
- * return -2: port too long
- * return -3: uri not starting with //
+/* start keeping a copy of a response for the cache in the cap bytes at
+ * buf, arena memory the copy moves out of once it outgrows it; the fetch
+ * is timed from here
  */
 
-int parse_uri(char* uri, char* port, char* host, char* rest){
-    int i = 0;
-    // we are assuming that the url starts with http 
-    // forward to the first //
-    char *host_start;
-    if((host_start = strstr(uri,"//")) != NULL){
-        host_start += 2;
-        while(*host_start != ':' && *host_start != '/'){
-            host[i++] = *host_start++;
-            if(i == HOST_CHAR_NUM){
-                fprintf(stderr, "host too long\n");
-                return -1;
-            }
+void resp_copy_init(resp_copy *copy, char *buf, size_t cap){
+    copy->buf = buf;
+    copy->len = 0;
+    copy->cap = cap;
+    copy->heap = 0;
+    copy->spill = NULL;
+    copy->dropped = 0;
+    clock_gettime(CLOCK_MONOTONIC, &copy->start);
+}
+
+/* add the next n bytes of the response to the copy, moving it to disk
+ * once it is too big for memory and dropping it once the response can't
+ * be cached anymore
+ */
+
+void resp_copy_append(resp_copy *copy, char *data, size_t n){
+    size_t cap;
+    char *buf;
+
+    if(copy->dropped){
+        return;
+    }
+    if(copy->spill == NULL && copy->len + n > cache_max_object){
+        if((copy->spill = disk_spill_open()) == NULL
+                || !disk_spill_write(copy->spill, copy->buf, copy->len)){
+            resp_copy_drop(copy);
+            return;
         }
-        host[i] = 0;                //the null terminator
-        i = 0;
-        // specified a port
-        if(*host_start == ':'){
-            host_start += 1;
-            while(*host_start >= '0' && *host_start <= '9'){
-                port[i++] = *host_start++;
-                if(i == PORT_CHAR_NUM){
-                    fprintf(stderr, "port too long\n");
-                    return -2;
-                }
-            }
+        // what was copied so far is on disk now
+        if(copy->heap){
+            free(copy->buf);
         }
-        // if not specified a port, the port string just contains a 0
-        port[i] = 0;
-        i = 0;
-        // grab the rest
-        while(*host_start != 0){
-            rest[i++] = *host_start++;
-            if(i == REST_CHAR_NUM){
-                fprintf(stderr,"rest too long\n");
-                return -3;
-            }
-        } 
-        // if directly terminating, still put a '/'
-        if(i == 0){
-            rest[i++] = '/';
+        copy->buf = NULL;
+        copy->cap = 0;
+        copy->heap = 0;
+    }
+    if(copy->spill != NULL){
+        if(!disk_spill_write(copy->spill, data, n)){
+            resp_copy_drop(copy);
+            return;
         }
-        rest[i] = 0;
-        return 0;
+        copy->len += n;
+        return;
     }
-    else{
-        fprintf(stderr, "uri:%s doesn't contain '//'\n",uri);
-        return -4; 
+    if(copy->len + n > copy->cap){
+        // grow by doubling, most objects are small
+        for(cap = copy->cap > 0 ? copy->cap : RELAY_BUF_SIZE;
+                cap < copy->len + n; cap *= 2){
+        }
+        if(cap > cache_max_object){
+            cap = cache_max_object;
+        }
+        if(copy->heap){
+            buf = realloc(copy->buf, cap);
+        }
+        else if((buf = malloc(cap)) != NULL){
+            memcpy(buf, copy->buf, copy->len);
+        }
+        if(buf == NULL){
+            resp_copy_drop(copy);
+            return;
+        }
+        copy->buf = buf;
+        copy->cap = cap;
+        copy->heap = 1;
     }
+    memcpy(copy->buf + copy->len, data, n);
+    copy->len += n;
 }
 
+/* a spilled response is indexed, or won't be: its followers can look */
+static void spill_done(void *fl, int ok){
+    flight_done((flight *)fl, ok);
+}
 
-/* validate whether this is a valid HTTP request
- * and forward the message
+/* hand the complete copy to the cache under uri, with how long it took
+ * to fetch, and finish fl if it isn't NULL: right away for memory, from
+ * the disk writer once a spilled response is indexed. The copy is left
+ * empty.
  */
 
-int validate_replace(client_info *client, char *forward_buf,
-                 char* host, char*port, char*uri){
+void resp_copy_store(resp_copy *copy, char *uri, flight *fl){
+    struct timespec now;
+    long fetch_us;
+    int stored;
 
-    ssize_t len;
-    int num_line = 0, num_tokens, has_end = 0, host_appear = 0;
-    char buf[MAXLINE];
-    char rest[REST_CHAR_NUM];
-    rio_t rio;
-    char write_buf[MAXLINE];
-    char tokens[MAX_TOKEN_NUM][MAX_TOKEN_LEN];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fetch_us = (now.tv_sec - copy->start.tv_sec) * 1000000L
+        + (now.tv_nsec - copy->start.tv_nsec) / 1000;
+    if(copy->spill != NULL){
+        // the writer has it queued, it only has to be found
+        disk_spill_commit(copy->spill, uri, fl != NULL ? spill_done : NULL,
+                fl);
+        copy->spill = NULL;
+    }
+    else{
+        // the cache keeps its own copy in a slab chunk
+        stored = cache_store(uri, copy->buf, copy->len, fetch_us);
+        if(fl != NULL){
+            flight_done(fl, stored);
+        }
+    }
+    resp_copy_free(copy);
+}
 
-    // Initialize RIO read structure
-    rio_readinitb(&rio, client->connfd);
+void resp_copy_free(resp_copy *copy){
+    if(copy->heap){
+        free(copy->buf);
+    }
+    if(copy->spill != NULL){
+        disk_spill_abort(copy->spill);
+        copy->spill = NULL;
+    }
+    copy->buf = NULL;
+    copy->len = 0;
+    copy->cap = 0;
+    copy->heap = 0;
+}
 
-    // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    Getnameinfo((SA *) &client->addr, client->addrlen,
-            client->host, sizeof(client->host),
-            client->serv, sizeof(client->serv),
-            0);
-    printf("Accepted connection from %s:%s\n", client->host, client->serv);
-    
-    while((len = rio_readlineb(&rio, buf, MAXLINE)) > 0){
-        if(num_line == 0){
-            num_tokens = tokenize(buf, MAX_TOKEN_NUM, MAX_TOKEN_LEN, tokens);
-            if(num_tokens < 2){
-                // the first line should contains at least 2 tokens
-                fprintf(stderr, 
-               "number of tokens:%d in first line less than 2\n",num_tokens);
-                return -1;
-            }
-            if(strcmp(tokens[0], "GET") != 0){
-                fprintf(stderr, 
-                  "Currently only support GET method, received %s\n",tokens[0]);
-                return -1;
-            }
-            if(parse_uri(tokens[1], port, host, rest) < 0){
-                fprintf(stderr, "Error in parsing uri\n");
+/* the response won't be cached, stop copying it */
+
+void resp_copy_drop(resp_copy *copy){
+    resp_copy_free(copy);
+    copy->dropped = 1;
+}
+
+void resp_copy_expect(resp_copy *copy, size_t total){
+    if(total > cache_max_object && total > disk_max_object()){
+        // too big for the cache, don't bother copying it
+        resp_copy_drop(copy);
+    }
+}
+
+/* move the rest of the body from fd to connfd through the pipe p, so it
+ * never enters user space; returns 0 if the client went away
+ */
+int splice_body(int fd, int connfd, int *p, http_resp *resp){
+    long long left;
+    ssize_t n, m;
+    size_t want;
+
+    while(resp->state != HR_DONE){
+        want = SPLICE_CHUNK;
+        if((left = http_resp_opaque(resp)) > 0 && left < (long long)want){
+            want = left;
+        }
+        if((n = splice(fd, NULL, p[1], NULL, want, SPLICE_F_MOVE)) < 0){
+            if(errno == EINTR){
+                continue;
             }
-            // get the uri    
-            strcpy(uri,tokens[1]);
-            // if the port not specified, use 80
-            if(*port == 0){
-                strcpy(port,"80");
+            fprintf(stderr, "Error reading response from server\n");
+            return 1;
+        }
+        if(n == 0){
+            http_resp_eof(resp);
+            return 1;
+        }
+        http_resp_skip(resp, n);
+        while(n > 0){
+            // hold back partial segments unless this is the end
+            m = splice(p[0], NULL, connfd, NULL, n, SPLICE_F_MOVE
+                    | (resp->state != HR_DONE ? SPLICE_F_MORE : 0));
+            if(m < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                fprintf(stderr, "Error writing to back to client\n");
+                return 0;
             }
+            n -= m;
+        }
+    }
+    return 1;
+}
 
-            // Fill out the write_buf: the 1st line
-            sprintf(forward_buf, "%s %s %s\r\n", 
-                request_method_get, rest, request_protocol);
+/* send the request to host:port, on a pooled connection if there is one,
+ * and relay the response to connfd as it arrives, through the
+ * RELAY_BUF_SIZE bytes at buf. keep_alive is cleared if the client can't find
+ * the end of the response without the connection being closed. If the
+ * client goes away while others wait on the flight fl, the rest is still
+ * read into the copy for them.
+ * Returns 1 if the whole response was relayed, or copied for fl, 0 if it
+ * was cut short, -1 if the origin sent nothing.
+ */
 
-            // Fill out the following line: user agent,connection...
-            sprintf(write_buf, "%s %s\r\n", 
-                header_ua_key, header_user_agent);
-            sprintf(write_buf, "%s%s %s\r\n",
-                write_buf, header_conn_key, header_conn_value);
-            sprintf(write_buf, "%s%s %s\r\n",
-                write_buf, header_proxconn_key, header_conn_value);
+int forward_get(char *host, char *port, char *forward_buf, int num_forward,
+        int connfd, char *buf, resp_copy *copy, flight *fl, int *keep_alive){
+    int client_fd, reused, client_ok = 1, p[2], iovcnt;
+    struct iovec iov[3];
+    ssize_t n = 0;
+    size_t len = 0, relayed = 0, used;
+    http_resp resp;
 
+    while(1){
+        reused = (client_fd = upstream_get(host, port)) >= 0;
+        // Open socket connection to server
+        if(!reused && (client_fd = dns_open_clientfd(host, port)) < 0){
+            fprintf(stderr, "Error connecting to %s:%s\n", host, port);
+            return -1;
         }
-        else{
-            if(strstr(buf,header_ua_key) != NULL){
-                // omit user agent
+
+        // Write line to server
+        if(rio_writen(client_fd, forward_buf, num_forward) < 0){
+            close(client_fd);
+            if(reused){
+                // the origin dropped the idle connection, use a new one
+                upstream_stale();
+                continue;
+            }
+            fprintf(stderr, "Error writing to server\n");
+            return -1;
+        }
+
+        http_resp_init(&resp);
+        while(resp.state != HR_DONE){
+            if((n = read(client_fd, buf + len, RELAY_BUF_SIZE - len)) < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                break;
             }
-            else if(strstr(buf,header_conn_key) != NULL){
-                // omit connection
+            if(n == 0){
+                http_resp_eof(&resp);
+                break;
             }
-            else if(strstr(buf, header_proxconn_key) != NULL){
-                // omit proxy connection
+            used = http_resp_feed(&resp, buf, len, n);
+            len += used;
+            if(used < (size_t)n){
+                // anything after the end isn't ours, don't reuse it
+                resp.keep_alive = 0;
             }
-            else if(strlen(buf) == 2 && strstr(buf,"\r\n") != NULL){
-                has_end = 1;
-                // if encounter the last line
-                if(!host_appear){
-                    // if host header didn't appear, write it
-                    sprintf(forward_buf,"%s%s %s\r\n",
-                        forward_buf,header_host_key,host);
+            if(resp.state == HR_HEADER){
+                if(len < RELAY_BUF_SIZE){
+                    // the header block is parsed in one piece
+                    continue;
                 }
-                sprintf(forward_buf, "%s%s\r\n", forward_buf,write_buf);
-                break;
+                // too big to parse, relay it until the origin closes
+                resp.state = HR_ERROR;
+                resp.keep_alive = 0;
             }
-            else{
-                // host is included in the header
-                if(strstr(buf, header_host_key) != NULL){
-                    host_appear = 1;
-                    sprintf(forward_buf,"%s%s",forward_buf,buf);
+            iov[0].iov_base = buf;
+            iov[0].iov_len = len;
+            iovcnt = 1;
+            if(relayed == 0){
+                // the header block is in: the Connection field is ours
+                *keep_alive = *keep_alive && http_resp_framed(&resp);
+                if(resp.state != HR_ERROR){
+                    len = http_resp_strip(&resp, buf, len);
+                    iovcnt = http_conn_iov(iov, buf, len, *keep_alive);
                 }
-                else{ 
-                    sprintf(write_buf, "%s%s", write_buf,buf);
+            }
+            if(http_resp_opaque(&resp) > 0){
+                resp_copy_expect(copy, relayed + len
+                        + http_resp_opaque(&resp));
+            }
+            // Write it on to the client
+            if(client_ok && writev_full(connfd, iov, iovcnt) < 0){
+                fprintf(stderr, "Error writing to back to client\n");
+                client_ok = 0;
+                *keep_alive = 0;
+                if(fl == NULL || copy->dropped || !flight_waiting(fl)){
+                    resp_copy_drop(copy);
+                    break;
                 }
+                // the followers still want it, finish fetching it for them
+            }
+            resp_copy_append(copy, buf, len);
+            relayed += len;
+            len = 0;
+            if(!client_ok && copy->dropped){
+                // nobody is left to take the rest
+                break;
+            }
+            if(relay_splice && copy->dropped && http_resp_opaque(&resp) != 0
+                    && pipe(p) == 0){
+                // it won't be cached, the rest can skip user space
+                client_ok = splice_body(client_fd, connfd, p, &resp);
+                close(p[0]);
+                close(p[1]);
+                break;
             }
         }
-        num_line++;
+        if(relayed + len == 0 && reused){
+            close(client_fd);
+            upstream_stale();
+            continue;
+        }
+        break;
     }
 
-
-    if(!has_end){
-        fprintf(stderr, "received http request without ending line\n");
+    if(resp.state == HR_DONE && resp.keep_alive){
+        upstream_put(host, port, client_fd);
+    }
+    else{
+        close(client_fd);
+    }
+    if(n < 0){
+        fprintf(stderr, "Error reading response from server\n");
+    }
+    // whatever arrived of a header block the origin cut short
+    if(len > 0 && client_ok && rio_writen(connfd, buf, len) == (ssize_t)len){
+        relayed += len;
+    }
+    if(relayed == 0){
         return -1;
     }
+    return (client_ok || !copy->dropped) && resp.state == HR_DONE;
 
-    return strlen(forward_buf); 
 }
 
-int forward_get(char *host, char *port, char *forward_buf, int num_forward, char *response_buf){
-    int client_fd, bytes_response;
-    rio_t rio;    
-    // Open socket connection to server
-    if ((client_fd = open_clientfd(host, port)) < 0) {
-        fprintf(stderr, "Error connecting to %s:%s\n", host, port);
-        return -1;
+
+/* write a cached response to the client and release the entry; returns
+ * whether the connection can stay open
+ */
+
+int serve_cached(client_info *client, cache_block *cache_entry,
+        int keep_alive){
+    struct iovec iov[3];
+    http_resp resp;
+    int real_write, iovcnt;
+
+    // it was stored without hop-by-hop fields, add our Connection field
+    http_resp_init(&resp);
+    http_resp_header(&resp, cache_entry->buf, cache_entry->bytes);
+    keep_alive = keep_alive && http_resp_framed(&resp);
+    iovcnt = http_conn_iov(iov, cache_entry->buf, cache_entry->bytes,
+            keep_alive);
+
+    // Write message back to client
+    if ((real_write = writev_full(client->connfd, iov, iovcnt)) < 0) {
+        fprintf(stderr, "Error writing to back to client, write %d\n", real_write);
+        keep_alive = 0;
     }
-    
-    // Initialize RIO read structure
-    rio_readinitb(&rio, client_fd);
+    // release the cache_entry
+    cache_read_done(cache_entry);
+    return keep_alive;
+}
 
-    // Write line to server
-    if (rio_writen(client_fd, forward_buf, num_forward) < 0) {
-        fprintf(stderr, "Error writing to server\n");
-        return -1;
+/* write a response kept on disk to the client, the body straight from
+ * its segment file, and release it; returns whether the connection can
+ * stay open
+ */
+
+int serve_disk(client_info *client, disk_hit *hit, int keep_alive){
+    struct iovec iov[3];
+    http_resp resp;
+    off_t off;
+    size_t left;
+    ssize_t n;
+    int iovcnt;
+
+    // the index has the header block, to add our Connection field to
+    http_resp_init(&resp);
+    http_resp_header(&resp, hit->hdr, hit->hdr_len);
+    keep_alive = keep_alive && http_resp_framed(&resp);
+    iovcnt = http_conn_iov(iov, hit->hdr, hit->hdr_len, keep_alive);
+    if(writev_full(client->connfd, iov, iovcnt) < 0){
+        fprintf(stderr, "Error writing to back to client\n");
+        keep_alive = 0;
     }
-    
-    if((bytes_response = rio_readnb(&rio, response_buf, MAX_RESPONSE_SIZE)) < 0){
-        fprintf(stderr, "Error reading response from server\n");
-        return -1;        
+    else{
+        off = hit->off + hit->hdr_len;
+        left = hit->bytes - hit->hdr_len;
+        while(left > 0){
+            if((n = sendfile(client->connfd, hit->fd, &off, left)) < 0
+                    && errno == EINTR){
+                continue;
+            }
+            if(n <= 0){
+                fprintf(stderr, "Error writing to back to client\n");
+                keep_alive = 0;
+                break;
+            }
+            left -= n;
+        }
     }
+    disk_hit_done(hit);
+    return keep_alive;
+}
 
-    return bytes_response;
+/* fetch the response from the origin and relay it to the client, for
+ * the followers of fl too if it is not NULL; fl is finished once the
+ * response is in the cache, or won't be
+ */
+
+void serve_fetch(client_info *client, req_bufs *b, int num_forward_bytes,
+        flight *fl, int *keep_alive){
+
+    resp_copy copy;
+    size_t cap;
+    char *relay_buf, *buf;
+    int rc;
 
+    // behind the request's buffers; serve_client takes them back
+    if((relay_buf = (char *)arena_alloc(client->arena,
+                    RELAY_BUF_SIZE)) == NULL){
+        fprintf(stderr, "out of memory for a fetch\n");
+        *keep_alive = 0;
+        if(fl != NULL){
+            flight_done(fl, 0);
+        }
+        return;
+    }
+    buf = arena_alloc_rest(client->arena, &cap);
+    resp_copy_init(&copy, buf, cap);
+    if((rc = forward_get(b->host, b->port, b->forward_buf, num_forward_bytes,
+                    client->connfd, relay_buf, &copy, fl, keep_alive)) < 0){
+        fprintf(stderr, "error when forwarding and getting response\n");
+    }
+    if(rc != 1){
+        // the client can't tell where a short response ends
+        *keep_alive = 0;
+    }
+    // if response is complete and small, cache it
+    if(rc == 1 && !copy.dropped){
+        resp_copy_store(&copy, b->uri, fl);
+    }
+    else if(fl != NULL){
+        flight_done(fl, 0);
+    }
+    // if not cached, free what outgrew the arena
+    resp_copy_free(&copy);
 }
 
+/* serve the next request on a client connection; returns whether the
+ * connection stays open for another one, which may_keep allows
+ */
 
-void *handle_connect(void *arg){
-    
-    pthread_detach(pthread_self());    
-    
-    client_info *client = (client_info *) arg; 
+int serve_request(client_info *client, rio_t *rio, int may_keep){
 
-    char forward_buf[MAXLINE];
-    char forward_host[HOST_CHAR_NUM];
-    char forward_port[PORT_CHAR_NUM];
-    char *response_buf;
-    int bytes_response, real_write, num_forward_bytes;
-    char uri[HOST_CHAR_NUM + REST_CHAR_NUM]; 
+    req_bufs *b;
+    int num_forward_bytes, leader, keep_alive = 0;
+    const char *reason;
    
     cache_block *cache_entry;
+    disk_hit hit;
+    flight *fl;
 
-    if((num_forward_bytes = 
-            validate_replace(client, forward_buf, 
-                forward_host, forward_port, uri)) < 0){
-        fprintf(stdout, "error parsing request\n");
+    // behind the rio buffer; serve_client takes them back
+    if((b = (req_bufs *)arena_alloc(client->arena, sizeof(req_bufs))) == NULL
+            || (b->req = (char *)arena_alloc(client->arena,
+                    client_max_header)) == NULL){
+        fprintf(stderr, "out of memory for a request\n");
+        return 0;
     }
-    else{
-        if((cache_entry = cache_exist(uri)) != NULL){
-            // if it is cached
-            bytes_response = cache_entry->bytes;
-            response_buf = cache_entry->buf;
-            // Write message back to client
-            if ((real_write = rio_writen(client->connfd, response_buf, bytes_response)) != bytes_response) {
-                fprintf(stderr, "Error writing to back to client, write %d\n", real_write);
-            }
-            // unlock the cache_entry
-            cache_read_done(cache_entry);
+    if((num_forward_bytes =
+            validate_replace(rio, client->arena, b, &keep_alive)) <= 0){
+        if(num_forward_bytes < 0){
+            // say why before hanging up
+            reason = num_forward_bytes == HTTP_TOO_LARGE ? header_too_large
+                : header_bad_request;
+            rio_writen(client->connfd, (void *)reason, strlen(reason));
+            fprintf(stdout, "error parsing request\n");
         }
-        else{
+        return 0;
+    }
+    keep_alive = keep_alive && may_keep;
+    if((cache_entry = cache_exist(b->uri)) != NULL){
+        // if it is cached
+        return serve_cached(client, cache_entry, keep_alive);
+    }
+    if(disk_lookup(b->uri, &hit)){
+        return serve_disk(client, &hit, keep_alive);
+    }
+    // if another client is already fetching it, wait for that
+    fl = flight_join(b->uri, &leader);
+    if(!leader && flight_wait(fl)){
+        if((cache_entry = cache_exist(b->uri)) != NULL){
+            return serve_cached(client, cache_entry, keep_alive);
+        }
+        if(disk_lookup(b->uri, &hit)){
+            return serve_disk(client, &hit, keep_alive);
+        }
+    }
+    // the leader, or a follower whose leader came back empty
+    serve_fetch(client, b, num_forward_bytes, leader ? fl : NULL,
+            &keep_alive);
+    return keep_alive;
+}
 
-            // dynamically allocate buffer for storing response
-            response_buf = (char *)malloc(MAX_RESPONSE_SIZE);
+/* serve the requests of one client connection, then close it */
 
-            if((bytes_response = forward_get(forward_host, forward_port, 
-                forward_buf, num_forward_bytes, response_buf)) < 0){
-                fprintf(stderr, "error when forwarding and getting response\n");
-            }
-            else{
-                // Write message back to client
-                if ((real_write = rio_writen(client->connfd, response_buf, bytes_response)) != bytes_response) {
-                    fprintf(stderr, "Error writing to back to client, write %d\n", real_write);
-                }
-                else{
-                    // if response is small, cache it
-                    if(bytes_response <= MAX_OBJECT_SIZE){
-                        cache_store(uri, response_buf, bytes_response);
-                    }
-                    else{
-                        // if not cached, free the buf
-                        free(response_buf);
-                    }
-                }
-            }
+void serve_client(client_info *client){
+    struct timeval idle;
+    rio_t *rio;
+    size_t start = arena_used(client->arena), mark;
+    int served = 0;
+
+    // Get some extra info about the client (hostname/port)
+    // This is optional, but it's nice to know who's connected
+    Getnameinfo((SA *) &client->addr, client->addrlen,
+            client->host, sizeof(client->host),
+            client->serv, sizeof(client->serv),
+            0);
+    printf("Accepted connection from %s:%s\n", client->host, client->serv);
+
+    // Initialize RIO read structure, kept across the requests
+    rio = (rio_t *)arena_alloc(client->arena, sizeof(rio_t));
+    rio_readinitb(rio, client->connfd);
+    mark = arena_used(client->arena);
+    // a client idle for client_idle seconds gives its thread back
+    idle.tv_sec = client_idle;
+    idle.tv_usec = 0;
+    setsockopt(client->connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+    while(serve_request(client, rio, ++served < client_max_requests)){
+        arena_reset(client->arena, mark);
+        if(rio->rio_cnt == 0){
+            // about to wait for the client, not on the fetch's buffers
+            arena_release(client->arena);
         }
     }
 
     // close the client
     Close(client->connfd);
-    free(client);
+    arena_reset(client->arena, start);
+}
 
-    return NULL;
+void *handle_connect(void *arg){
+    
+    pthread_detach(pthread_self());    
+    
+    client_info *client = (client_info *) arg; 
+    arena *a = client->arena;
 
+    serve_client(client);
+    // client_info was carved out of the arena too
+    arena_put(a);
+
+    return NULL;
 }
 
-int main(int argc, char** argv) {
+/* accept loop of the thread-per-connection server, for listener shard
+ * (long)arg or, if that is -1, the shared listener
+ */
 
-    if(argc != 2){
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(0);
-    }
-    char *self_port = argv[1];
-    int listenfd;
+static int thread_listenfd;
+
+void *thread_acceptor(void *arg){
+    int shard = (int)(long)arg;
+    int listenfd = shard >= 0 ? shard_listenfd(shard) : thread_listenfd;
     pthread_t tid;
-    
     client_info *client;
+    arena *a;
+    int rc;
 
-    cache_init();
-
-    // Start listening on the given port number
-    if((listenfd = Open_listenfd(self_port)) < 0){
-        fprintf(stderr,"can not listen on port:%s, errnum:%d\n",self_port,listenfd);
+    if(shard >= 0){
+        shard_pin(shard);
     }
-    fprintf(stdout,"listening on port:%s\n",self_port);
-    
-
     while(1){
-        // Allocate space on the stack for client info
-        client = (client_info *)malloc(sizeof(client_info));
+        // client info and the connection's buffers share an arena
+        if((a = arena_get()) == NULL){
+            fprintf(stderr, "out of memory, not accepting for a second\n");
+            sleep(1);
+            continue;
+        }
+        client = (client_info *)arena_alloc(a, sizeof(client_info));
+        client->arena = a;
 
         // Initialize the length of the address
         client->addrlen = sizeof(client->addr);
@@ -360,11 +817,333 @@ int main(int argc, char** argv) {
         // Accept() will block until a client connects to the port
         client->connfd = Accept(listenfd, 
                 (SA*) &client->addr, &client->addrlen);
+        if(shard >= 0){
+            shard_accepted(shard);
+        }
         
-        pthread_create(&tid, NULL, &handle_connect, client);
+        if((rc = pthread_create(&tid, NULL, &handle_connect, client)) != 0){
+            // out of threads: drop this client rather than the proxy
+            fprintf(stderr, "pthread_create error: %s\n", strerror(rc));
+            Close(client->connfd);
+            arena_put(a);
+        }
+    }
+    return NULL;
+}
+
+/* serve every connection on its own detached thread */
+
+void serve_threads(int listenfd){
+    pthread_t tid;
+    int i;
 
+    thread_listenfd = listenfd;
+    for(i = 1; i < shard_count(); i++){
+        Pthread_create(&tid, NULL, thread_acceptor, (void *)(long)i);
     }
+    thread_acceptor((void *)(long)(shard_count() > 0 ? 0 : -1));
+}
 
-    return 0;
+/* print statistics whenever the proxy gets SIGUSR1 */
+
+void *stats_thread(void *arg){
+    sigset_t *mask = (sigset_t *)arg;
+    int sig;
+
+    while(1){
+        if(sigwait(mask, &sig) == 0){
+            shard_report(stdout);
+            pool_report(stdout);
+            upstream_report(stdout);
+            dns_report(stdout);
+            flight_report(stdout);
+            arena_report(stdout);
+            cache_report(stdout);
+            slab_report(stdout);
+            disk_report(stdout);
+            fflush(stdout);
+        }
+    }
+    return NULL;
+}
+
+void usage(char *prog){
+    fprintf(stderr, "usage: %s [-c config file] [-m thread|pool|event] "
+            "[-t threads] [-q queue depth] [-r listener shards] [-u] "
+            "[-k upstream idle secs] [-K upstream idle per origin] "
+            "[-d dns ttl] [-Z] [-i client idle secs] "
+            "[-n requests per client connection] "
+            "[-H max request header bytes] [-N cache shards] "
+            "[-p recency|tinylfu|gdsf] [-C cache bytes] "
+            "[-O max object bytes] [-E max cache entries] "
+            "[-D disk cache dir] [-S disk cache bytes] <port>\n", prog);
+    exit(0);
 }
 
+/* what the command line and config files set, before anything starts */
+typedef struct {
+    int mode;
+    int nthreads;
+    int depth;
+    int nshards;
+    int use_uring;
+    int upstream_idle;
+    int upstream_max;
+    int dns_ttl;
+    int cache_shards;
+    int cache_policy;
+    size_t cache_size;
+    size_t cache_entries;
+    char *disk_dir;             // NULL for no disk tier
+    size_t disk_size;
+} proxy_config;
+
+/* config file settings, each the same as an option */
+static const struct {
+    const char *name;
+    int opt;
+} config_names[] = {
+    {"mode", 'm'}, {"threads", 't'}, {"queue-depth", 'q'},
+    {"listener-shards", 'r'}, {"uring", 'u'}, {"upstream-idle", 'k'},
+    {"upstream-max-idle", 'K'}, {"dns-ttl", 'd'}, {"no-splice", 'Z'},
+    {"client-idle", 'i'}, {"client-max-requests", 'n'},
+    {"max-header", 'H'}, {"cache-shards", 'N'}, {"cache-policy", 'p'},
+    {"cache-size", 'C'}, {"max-object", 'O'}, {"max-entries", 'E'},
+    {"disk-dir", 'D'}, {"disk-size", 'S'},
+};
+
+/* a byte count, maybe with a k, m or g suffix; 0 if it isn't one */
+static size_t parse_size(const char *arg){
+    char *end;
+    unsigned long long n;
+
+    if(*arg < '0' || *arg > '9'){
+        return 0;
+    }
+    n = strtoull(arg, &end, 10);
+    switch(*end){
+    case 'g': case 'G':
+        n *= 1024;
+        /* fall through */
+    case 'm': case 'M':
+        n *= 1024;
+        /* fall through */
+    case 'k': case 'K':
+        n *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' ? n : 0;
+}
+
+static void load_config(proxy_config *cfg, const char *path);
+
+/* apply option opt with its argument; 0 if the argument is no good */
+static int set_option(proxy_config *cfg, int opt, char *arg){
+    switch(opt){
+    case 'c':
+        load_config(cfg, arg);
+        return 1;
+    case 'm':
+        if(strcmp(arg, "thread") == 0){
+            cfg->mode = MODE_THREAD;
+        }
+        else if(strcmp(arg, "pool") == 0){
+            cfg->mode = MODE_POOL;
+        }
+        else if(strcmp(arg, "event") == 0){
+            cfg->mode = MODE_EVENT;
+        }
+        else{
+            return 0;
+        }
+        return 1;
+    case 't':
+        return (cfg->nthreads = atoi(arg)) > 0;
+    case 'q':
+        return (cfg->depth = atoi(arg)) > 0;
+    case 'r':
+        return (cfg->nshards = atoi(arg)) > 0;
+    case 'u':
+        cfg->use_uring = 1;
+        return 1;
+    case 'k':
+        return (cfg->upstream_idle = atoi(arg)) > 0;
+    case 'K':
+        // 0 turns pooling off
+        return (cfg->upstream_max = atoi(arg)) >= 0;
+    case 'Z':
+        // copy uncacheable responses through user space too
+        relay_splice = 0;
+        return 1;
+    case 'd':
+        // 0 turns the resolver cache off
+        return (cfg->dns_ttl = atoi(arg)) >= 0;
+    case 'i':
+        return (client_idle = atoi(arg)) > 0;
+    case 'n':
+        // 1 turns client keep-alive off
+        return (client_max_requests = atoi(arg)) > 0;
+    case 'H':
+        client_max_header = atoi(arg);
+        return client_max_header > 0
+            && client_max_header <= CLIENT_MAX_HEADER_LIMIT;
+    case 'N':
+        return (cfg->cache_shards = atoi(arg)) > 0;
+    case 'p':
+        if(strcmp(arg, "recency") == 0){
+            cfg->cache_policy = CACHE_POLICY_RECENCY;
+        }
+        else if(strcmp(arg, "tinylfu") == 0){
+            cfg->cache_policy = CACHE_POLICY_TINYLFU;
+        }
+        else if(strcmp(arg, "gdsf") == 0){
+            cfg->cache_policy = CACHE_POLICY_GDSF;
+        }
+        else{
+            return 0;
+        }
+        return 1;
+    case 'C':
+        return (cfg->cache_size = parse_size(arg)) > 0;
+    case 'O':
+        return (cache_max_object = parse_size(arg)) > 0;
+    case 'E':
+        // 0 for no limit
+        cfg->cache_entries = parse_size(arg);
+        return cfg->cache_entries > 0 || strcmp(arg, "0") == 0;
+    case 'D':
+        // a config file's line doesn't last
+        return *arg != '\0' && (cfg->disk_dir = strdup(arg)) != NULL;
+    case 'S':
+        return (cfg->disk_size = parse_size(arg)) > 0;
+    default:
+        return 0;
+    }
+}
+
+/* read "name value" lines, the value left out for a setting that takes
+ * none, each applied as its option would be; # starts a comment
+ */
+static void load_config(proxy_config *cfg, const char *path){
+    char line[MAXLINE], *name, *arg, *save;
+    FILE *fp;
+    size_t i;
+    int lineno = 0;
+
+    if((fp = fopen(path, "r")) == NULL){
+        fprintf(stderr, "can not read config file %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    while(fgets(line, sizeof(line), fp) != NULL){
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        if((name = strtok_r(line, " \t", &save)) == NULL){
+            continue;
+        }
+        arg = strtok_r(NULL, " \t", &save);
+        for(i = 0; i < sizeof(config_names) / sizeof(config_names[0]); i++){
+            if(strcmp(name, config_names[i].name) == 0){
+                break;
+            }
+        }
+        if(i == sizeof(config_names) / sizeof(config_names[0])
+                || strtok_r(NULL, " \t", &save) != NULL
+                || !set_option(cfg, config_names[i].opt,
+                    arg != NULL ? arg : "")){
+            fprintf(stderr, "%s:%d: bad setting %s\n", path, lineno, name);
+            exit(1);
+        }
+    }
+    fclose(fp);
+}
+
+int main(int argc, char** argv) {
+
+    int listenfd, opt;
+    proxy_config cfg = {
+        .mode = MODE_EVENT,
+        .depth = POOL_DEFAULT_DEPTH,
+        .upstream_idle = UPSTREAM_DEFAULT_IDLE,
+        .upstream_max = UPSTREAM_DEFAULT_MAX_IDLE,
+        .dns_ttl = DNS_DEFAULT_TTL,
+        .cache_shards = CACHE_DEFAULT_SHARDS,
+        .cache_policy = CACHE_POLICY_TINYLFU,
+        .cache_size = CACHE_DEFAULT_SIZE,
+        .disk_size = DISK_DEFAULT_SIZE,
+    };
+    static sigset_t stats_mask;
+    pthread_t tid;
+
+    // settings apply in order, so a later one wins
+    while((opt = getopt(argc, argv, "c:m:t:q:r:uk:K:d:Zi:n:H:N:p:C:O:E:D:S:"))
+            != -1){
+        if(!set_option(&cfg, opt, optarg)){
+            usage(argv[0]);
+        }
+    }
+    // io_uring is a backend of the event loops, and every cache shard
+    // must be able to hold a full-size object
+    if(optind != argc - 1 || (cfg.use_uring && cfg.mode != MODE_EVENT)
+            || cache_max_object > cfg.cache_size / cfg.cache_shards){
+        usage(argv[0]);
+    }
+    char *self_port = argv[optind];
+    if(cfg.nthreads == 0){
+        // event loops never block, pool workers do
+        cfg.nthreads = cfg.mode == MODE_POOL ? POOL_DEFAULT_WORKERS
+            : sysconf(_SC_NPROCESSORS_ONLN);
+        if(cfg.nthreads <= 0){
+            cfg.nthreads = 1;
+        }
+    }
+
+    // a client hanging up must not kill the proxy
+    Signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 is blocked everywhere and taken by stats_thread
+    Sigemptyset(&stats_mask);
+    Sigaddset(&stats_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_mask, NULL);
+    Pthread_create(&tid, NULL, stats_thread, &stats_mask);
+
+    scan_init();
+    arena_init();
+    slab_init(cfg.cache_size);
+    cache_init(cfg.cache_shards, cfg.cache_policy, cfg.cache_size,
+            cfg.cache_entries);
+    disk_init(cfg.disk_dir, cfg.disk_size);
+    upstream_init(cfg.upstream_idle, cfg.upstream_max);
+    dns_init(cfg.dns_ttl);
+    flight_init();
+
+    // Start listening on the given port number
+    if(cfg.nshards > 0){
+        // one SO_REUSEPORT listener per accepting thread
+        shard_init(self_port, cfg.nshards);
+        listenfd = -1;
+        fprintf(stdout,"listening on port:%s with %d shards\n",
+                self_port, cfg.nshards);
+    }
+    else{
+        if((listenfd = Open_listenfd(self_port)) < 0){
+            fprintf(stderr,"can not listen on port:%s, errnum:%d\n",self_port,listenfd);
+        }
+        fprintf(stdout,"listening on port:%s\n",self_port);
+    }
+    
+    switch(cfg.mode){
+    case MODE_THREAD:
+        serve_threads(listenfd);
+        break;
+    case MODE_POOL:
+        pool_serve(listenfd, cfg.nthreads, cfg.depth);
+        break;
+    default:
+        event_serve(listenfd, cfg.nthreads, cfg.use_uring);
+        break;
+    }
+
+    return 0;
+}
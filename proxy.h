@@ -0,0 +1,75 @@
+/*
+ * proxy.h - definitions shared by the proxy front ends
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "http.h"
+#include "arena.h"
+#include "disk.h"
+#include "flight.h"
+
+#define HOSTLEN 256
+#define SERVLEN 8
+#define RELAY_BUF_SIZE 16384   // response bytes in transit per connection
+#define SPLICE_CHUNK 65536      // bytes spliced at a time, one pipe's worth
+#define CLIENT_DEFAULT_IDLE 15  // secs a client connection may sit idle
+#define CLIENT_DEFAULT_MAX_REQUESTS 100 // requests per client connection
+#define CLIENT_DEFAULT_MAX_HEADER 8192  // bytes of a request header block
+#define CLIENT_MAX_HEADER_LIMIT (32 * 1024) // most -H allows, to fit an arena
+#define DEBUG 0
+
+// Information about a connected client.
+typedef struct {
+    struct sockaddr_in addr;    // Socket address
+    socklen_t addrlen;          // Socket address length
+    int connfd;                 // Client connection file descriptor
+    char host[HOSTLEN];         // Client host
+    char serv[SERVLEN];         // Client service (port)
+    arena *arena;               // where the connection's buffers come from
+} client_info;
+
+/* copy of a response being relayed, kept while it can still be cached */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int heap;                   // buf is from malloc, not an arena
+    disk_spill *spill;          // where it goes instead once too big for
+                                // memory, NULL while it is in buf
+    int dropped;                // too big, or out of memory
+    struct timespec start;      // when the fetch began, to cost a miss
+} resp_copy;
+
+/* splice uncacheable response bodies instead of copying them (-Z) */
+extern int relay_splice;
+/* client keep-alive limits (-i, -n) */
+extern int client_idle;
+extern int client_max_requests;
+/* largest request header block taken (-H) */
+extern int client_max_header;
+/* largest response copied for the cache (-O) */
+extern size_t cache_max_object;
+/* the answer to a request whose header block is too large */
+extern const char header_too_large[];
+/* ... and to one that can't be parsed */
+extern const char header_bad_request[];
+
+/* serve the requests of one client connection, then close it; its
+ * buffers are carved out of client->arena and dropped again at the end
+ */
+void serve_client(client_info *client);
+/* rewrite a request parsed from req into the upstream request, carving
+ * it and the host, port and uri strings out of a
+ */
+int rewrite_request(http_req *r, const char *req, arena *a,
+        char **forward_buf, char **host, char **port, char **uri);
+void resp_copy_init(resp_copy *copy, char *buf, size_t cap);
+void resp_copy_append(resp_copy *copy, char *data, size_t n);
+void resp_copy_store(resp_copy *copy, char *uri, flight *fl);
+void resp_copy_free(resp_copy *copy);
+void resp_copy_drop(resp_copy *copy);
+/* the response will be total bytes: stop copying if no tier takes that */
+void resp_copy_expect(resp_copy *copy, size_t total);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,164 @@
+/*
+ * scan.c - vectorized scanning of header bytes
+ *
+ * Finding line ends one memchr at a time costs a call per header line,
+ * and most lines are shorter than a vector register is wide. scan_block
+ * instead compares a whole 64-byte block against '\n' and ':' at once
+ * and hands back bitmaps, so the parser walks a block's lines with bit
+ * tricks. The kernel is picked once at startup from what cpuid says the
+ * cpu has: AVX2, SSE2 (always there on x86-64), or eight bytes at a time
+ * in plain C.
+ */
+#include "csapp.h"
+#include <strings.h>
+#include "scan.h"
+
+// SCAN_NO_SSE2 and SCAN_NO_AVX2 leave kernels out, to compare them
+#if defined(__SSE2__) && !defined(SCAN_NO_SSE2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#if defined(__x86_64__) && !defined(SCAN_NO_AVX2) && (defined(__clang__) \
+        || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+// target("avx2") functions need gcc 4.9's per-function intrinsics
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+
+typedef void (*scan_fn)(const char *buf, uint64_t *nl, uint64_t *colon);
+
+#ifndef HAVE_SSE2
+#define ONES 0x0101010101010101ULL
+#define LOW7 0x7f7f7f7f7f7f7f7fULL
+
+/* one bit per byte of x that equals the byte c, eight bytes at a time */
+static unsigned swar_eq(uint64_t x, unsigned char c){
+    uint64_t t = x ^ (ONES * c);
+
+    // high bit of each zero byte of t, without borrows between bytes
+    t = ~(((t & LOW7) + LOW7) | t | LOW7);
+    return (unsigned)(((t >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+static void scan_scalar(const char *buf, uint64_t *nl, uint64_t *colon){
+    uint64_t n = 0, c = 0, x;
+    int i;
+
+    for(i = 0; i < SCAN_BLOCK; i += 8){
+        memcpy(&x, buf + i, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+        n |= (uint64_t)swar_eq(x, '\n') << i;
+        c |= (uint64_t)swar_eq(x, ':') << i;
+    }
+    *nl = n;
+    *colon = c;
+}
+#else
+static void scan_sse2(const char *buf, uint64_t *nl, uint64_t *colon){
+    __m128i lf = _mm_set1_epi8('\n'), co = _mm_set1_epi8(':'), v;
+    uint64_t n = 0, c = 0;
+    int i;
+
+    for(i = 0; i < SCAN_BLOCK; i += 16){
+        v = _mm_loadu_si128((const __m128i *)(buf + i));
+        n |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) << i;
+        c |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, co)) << i;
+    }
+    *nl = n;
+    *colon = c;
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static void scan_avx2(const char *buf, uint64_t *nl, uint64_t *colon){
+    __m256i lf = _mm256_set1_epi8('\n'), co = _mm256_set1_epi8(':');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)buf);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(buf + 32));
+
+    *nl = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, lf))
+        | (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, lf))
+            << 32;
+    *colon = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, co))
+        | (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, co))
+            << 32;
+}
+#endif
+
+#ifdef HAVE_SSE2
+static scan_fn kernel = scan_sse2;
+#else
+static scan_fn kernel = scan_scalar;
+#endif
+
+const char *scan_init(void){
+#ifdef HAVE_AVX2
+    if(__builtin_cpu_supports("avx2")){
+        kernel = scan_avx2;
+        return "avx2";
+    }
+#endif
+#ifdef HAVE_SSE2
+    kernel = scan_sse2;
+    return "sse2";
+#else
+    kernel = scan_scalar;
+    return "scalar";
+#endif
+}
+
+void scan_block(const char *buf, size_t n, uint64_t *nl, uint64_t *colon){
+    char tail[SCAN_BLOCK];
+
+    if(n < SCAN_BLOCK){
+        // the kernels read a whole block; NULs match neither byte
+        memset(tail, 0, SCAN_BLOCK);
+        memcpy(tail, buf, n);
+        buf = tail;
+    }
+    kernel(buf, nl, colon);
+}
+
+size_t scan_space(const char *s, size_t n){
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), v;
+    unsigned m;
+
+    for(; i + 16 <= n; i += 16){
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                    _mm_cmpeq_epi8(v, tab)));
+        if(m != 0){
+            return i + __builtin_ctz(m);
+        }
+    }
+#endif
+    for(; i < n && s[i] != ' ' && s[i] != '\t'; i++){
+    }
+    return i;
+}
+
+int scan_word(const char *s, size_t n, size_t avail, const char *w){
+#ifdef HAVE_SSE2
+    __m128i v, p, letter;
+    unsigned want;
+
+    if(n <= SCAN_WORD && avail >= SCAN_WORD){
+        v = _mm_loadu_si128((const __m128i *)s);
+        p = _mm_loadu_si128((const __m128i *)w);
+        // fold case only where w has a letter, so '\r' never passes for '-'
+        letter = _mm_and_si128(_mm_cmpgt_epi8(p, _mm_set1_epi8('a' - 1)),
+                _mm_cmplt_epi8(p, _mm_set1_epi8('z' + 1)));
+        v = _mm_or_si128(v, _mm_and_si128(letter, _mm_set1_epi8(0x20)));
+        want = n == SCAN_WORD ? 0xffff : (1u << n) - 1;
+        return ((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, p)) & want)
+            == want;
+    }
+#else
+    (void)avail;
+#endif
+    return strncasecmp(s, w, n) == 0;
+}
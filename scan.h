@@ -0,0 +1,27 @@
+/*
+ * scan.h - vectorized scanning of header bytes
+ */
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_BLOCK 64           // bytes looked at by one scan_block
+#define SCAN_WORD 16            // longest word scan_word compares at once
+
+/* pick the widest kernel the cpu has; returns its name */
+const char *scan_init(void);
+/* set bit i of *nl where buf[i] is '\n' and bit i of *colon where it
+ * is ':', for the first n bytes of buf (only SCAN_BLOCK are looked at)
+ */
+void scan_block(const char *buf, size_t n, uint64_t *nl, uint64_t *colon);
+/* offset of the first ' ' or '\t' in the n bytes at s, n if none */
+size_t scan_space(const char *s, size_t n);
+/* are the n bytes at s the lower-case word w, ignoring the case of
+ * letters? w is padded with NULs to SCAN_WORD bytes; avail is how many
+ * bytes may be read at s
+ */
+int scan_word(const char *s, size_t n, size_t avail, const char *w);
+
+#endif /* __SCAN_H__ */
@@ -0,0 +1,92 @@
+/*
+ * shard.c - SO_REUSEPORT listener shards
+ *
+ * Instead of one listening socket that every accepting thread fights
+ * over, each shard gets its own SO_REUSEPORT socket on the same port and
+ * the kernel spreads incoming connections over them. The thread serving
+ * a shard is pinned to a cpu of its own, so accept() never serializes.
+ */
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <sched.h>
+#include "shard.h"
+
+typedef struct {
+    int listenfd;
+    int cpu;                    // cpu the owning thread is pinned to
+    unsigned long accepted;     // connections accepted on this shard
+} shard_t;
+
+static shard_t *shards;
+static int nshards;
+
+void shard_init(char *port, int n){
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int i, ncpus = 0;
+
+    // shards go round robin over the cpus we are allowed to run on
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+        for(i = 0; i < CPU_SETSIZE; i++){
+            if(CPU_ISSET(i, &allowed)){
+                cpus[ncpus++] = i;
+            }
+        }
+    }
+
+    shards = (shard_t *)Calloc(n, sizeof(shard_t));
+    nshards = n;
+    for(i = 0; i < n; i++){
+        shards[i].listenfd = Open_reuseport_listenfd(port);
+        shards[i].cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+    }
+}
+
+int shard_count(void){
+    return nshards;
+}
+
+int shard_listenfd(int i){
+    return shards[i].listenfd;
+}
+
+void shard_pin(int i){
+    cpu_set_t set;
+    int rc;
+
+    if(shards[i].cpu < 0){
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(shards[i].cpu, &set);
+    if((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0){
+        fprintf(stderr, "shard %d: can not pin to cpu %d: %s\n",
+                i, shards[i].cpu, strerror(rc));
+    }
+}
+
+void shard_accepted(int i){
+    __atomic_fetch_add(&shards[i].accepted, 1, __ATOMIC_RELAXED);
+}
+
+void shard_report(FILE *fp){
+    unsigned long cnt, total = 0, min = 0, max = 0;
+    int i;
+
+    for(i = 0; i < nshards; i++){
+        cnt = __atomic_load_n(&shards[i].accepted, __ATOMIC_RELAXED);
+        fprintf(fp, "shard %d (cpu %d): %lu accepted\n",
+                i, shards[i].cpu, cnt);
+        total += cnt;
+        if(i == 0 || cnt < min){
+            min = cnt;
+        }
+        if(cnt > max){
+            max = cnt;
+        }
+    }
+    if(nshards > 0){
+        fprintf(fp, "shards: %lu accepted, min %lu max %lu per shard\n",
+                total, min, max);
+    }
+}
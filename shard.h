@@ -0,0 +1,19 @@
+/*
+ * shard.h - SO_REUSEPORT listener shards
+ */
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+/* open n SO_REUSEPORT listeners on port; exits on failure */
+void shard_init(char *port, int n);
+/* number of shards, 0 when running with a single listener */
+int shard_count(void);
+int shard_listenfd(int i);
+/* pin the calling thread to the cpu that owns shard i */
+void shard_pin(int i);
+/* count a connection accepted by shard i */
+void shard_accepted(int i);
+/* print per-shard connection counts */
+void shard_report(FILE *fp);
+
+#endif /* __SHARD_H__ */
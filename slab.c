@@ -0,0 +1,354 @@
+/*
+ * slab.c - size class allocator for cached responses
+ *
+ * Cache entries (the block, its response and its uri together) live in
+ * one region of address space reserved up front, SLAB_RESERVE times the
+ * cache budget, and handed out in SLAB_UNIT sized units. The kernel only
+ * backs what has been touched, and a freed unit is handed out again
+ * rather than going back to malloc, so churn doesn't fragment the heap.
+ *
+ * Entries up to half a unit come in small size classes, each
+ * SLAB_GROWTH percent of the last, carved out of units of one class; a
+ * unit goes back to the region when its last chunk is freed. Larger
+ * entries take a run of whole units. Free runs are merged with their
+ * neighbours and kept in bins by length, so the best fit is found
+ * without searching the region. Either way an entry wastes at most the
+ * step to its class or part of a unit.
+ *
+ * What an entry is charged against the cache budget is what it holds:
+ * its units, or its share of one, and the same share of what is kept
+ * beside each unit (about 4% more). Only the bit a unit has in the used
+ * map goes uncharged.
+ */
+#include "csapp.h"
+#include <stdint.h>
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+#define SLAB_CLASSES 32         // more than SLAB_GROWTH ever makes
+#define SLAB_BINS 256           // free run lengths kept apart, a multiple of 64
+
+typedef struct slab_page slab_page;
+
+/* a unit carved into chunks of one class; kept beside the region */
+struct slab_page{
+    slab_page *prev;            // among its class's pages with free chunks
+    slab_page *next;
+    char *free;                 // freed chunks, linked through their first word
+    int carved;                 // bytes of the unit handed out so far
+    int cls;
+    int used;                   // chunks in use
+};
+
+typedef struct {
+    sem_t mutex;                // protects its pages
+    int size;                   // of a chunk
+    int per_page;
+    slab_page *partial;         // pages with a chunk to spare
+} slab_class;
+
+static slab_class classes[SLAB_CLASSES];
+static int nclasses;
+
+/* a run of free units, described at its first and last unit */
+typedef struct {
+    long len;
+    long prev, next;            // first units of its bin's neighbours,
+                                // at the first unit only
+} slab_run;
+
+/* what is kept beside the region about a unit: a unit carved into
+ * chunks is never part of a free run
+ */
+typedef union {
+    slab_page page;             // the first member, to find the unit again
+    slab_run run;
+} slab_unit;
+
+static sem_t region_mutex;      // protects the map, runs, bins and count
+static char *region;
+static long nunits;
+static uint64_t *used_map;      // a bit per unit, set if it is handed out
+static slab_unit *units;        // one per unit of the region
+static long bins[SLAB_BINS];    // free runs by length, the last bin longer
+static uint64_t bins_used[SLAB_BINS / 64];      // a bit per non-empty bin
+static long units_used;
+
+static int units_used_at(long u){
+    return used_map[u / 64] >> (u % 64) & 1;
+}
+
+static void units_mark(long u, long n, int used){
+    for(; n > 0; u++, n--){
+        if(used){
+            used_map[u / 64] |= (uint64_t)1 << (u % 64);
+        }
+        else{
+            used_map[u / 64] &= ~((uint64_t)1 << (u % 64));
+        }
+    }
+}
+
+static int run_bin(long len){
+    return len < SLAB_BINS ? len : SLAB_BINS - 1;
+}
+
+static void run_add(long u, long len){
+    int b = run_bin(len);
+
+    units[u].run.len = units[u + len - 1].run.len = len;
+    units[u].run.prev = -1;
+    units[u].run.next = bins[b];
+    if(bins[b] >= 0){
+        units[bins[b]].run.prev = u;
+    }
+    bins[b] = u;
+    bins_used[b / 64] |= (uint64_t)1 << (b % 64);
+}
+
+static void run_del(long u){
+    int b = run_bin(units[u].run.len);
+
+    if(units[u].run.prev >= 0){
+        units[units[u].run.prev].run.next = units[u].run.next;
+    }
+    else if((bins[b] = units[u].run.next) < 0){
+        bins_used[b / 64] &= ~((uint64_t)1 << (b % 64));
+    }
+    if(units[u].run.next >= 0){
+        units[units[u].run.next].run.prev = units[u].run.prev;
+    }
+}
+
+/* a free run of at least n units from the smallest bin that has one,
+ * or -1
+ */
+static long run_find(long n){
+    int b = run_bin(n), i;
+    uint64_t w;
+    long u;
+
+    for(i = b / 64; i < SLAB_BINS / 64; i++){
+        w = bins_used[i];
+        if(i == b / 64){
+            w &= ~(uint64_t)0 << (b % 64);
+        }
+        if(w != 0){
+            b = i * 64 + __builtin_ctzll(w);
+            break;
+        }
+    }
+    if(i == SLAB_BINS / 64){
+        return -1;
+    }
+    // runs in the last bin come in any length
+    for(u = bins[b]; u >= 0 && units[u].run.len < n; u = units[u].run.next){
+    }
+    return u;
+}
+
+/* the first of n free units in a row, or -1 if no run is that long.
+ * The best fit leaves long runs whole for the entries that need them;
+ * what is left of the run goes back in its bin.
+ */
+static long units_alloc(long n){
+    long u, len;
+
+    P(&region_mutex);
+    if((u = run_find(n)) < 0){
+        V(&region_mutex);
+        return -1;
+    }
+    len = units[u].run.len;
+    run_del(u);
+    if(len > n){
+        run_add(u + n, len - n);
+    }
+    units_mark(u, n, 1);
+    units_used += n;
+    V(&region_mutex);
+    return u;
+}
+
+/* give back n units at u, merged with the free runs either side */
+static void units_free(long u, long n){
+    long len;
+
+    P(&region_mutex);
+    units_mark(u, n, 0);
+    units_used -= n;
+    if(u > 0 && !units_used_at(u - 1)){
+        len = units[u - 1].run.len;
+        u -= len;
+        n += len;
+        run_del(u);
+    }
+    if(u + n < nunits && !units_used_at(u + n)){
+        len = units[u + n].run.len;
+        run_del(u + n);
+        n += len;
+    }
+    run_add(u, n);
+    V(&region_mutex);
+}
+
+void slab_init(size_t budget){
+    int size = SLAB_MIN, i;
+
+    nunits = (budget * SLAB_RESERVE + SLAB_UNIT - 1) / SLAB_UNIT;
+    region = Mmap(NULL, (size_t)nunits * SLAB_UNIT, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    used_map = (uint64_t *)Calloc((nunits + 63) / 64, sizeof(uint64_t));
+    units = (slab_unit *)Calloc(nunits, sizeof(slab_unit));
+    Sem_init(&region_mutex, 0, 1);
+    for(i = 0; i < SLAB_BINS; i++){
+        bins[i] = -1;
+    }
+    run_add(0, nunits);
+
+    while(size <= SLAB_UNIT / 2){
+        Sem_init(&classes[nclasses].mutex, 0, 1);
+        classes[nclasses].size = size;
+        classes[nclasses].per_page = SLAB_UNIT / size;
+        nclasses++;
+        size = (size * SLAB_GROWTH / 100 + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    }
+}
+
+/* the smallest small class holding n bytes, or -1 */
+static int slab_class_of(size_t n){
+    int lo = 0, hi = nclasses - 1, mid;
+
+    if(n > (size_t)classes[hi].size){
+        return -1;
+    }
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if((size_t)classes[mid].size < n){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void partial_add(slab_class *c, slab_page *pg){
+    pg->prev = NULL;
+    pg->next = c->partial;
+    if(c->partial != NULL){
+        c->partial->prev = pg;
+    }
+    c->partial = pg;
+}
+
+static void partial_del(slab_class *c, slab_page *pg){
+    if(pg->prev != NULL){
+        pg->prev->next = pg->next;
+    }
+    else{
+        c->partial = pg->next;
+    }
+    if(pg->next != NULL){
+        pg->next->prev = pg->prev;
+    }
+}
+
+/* a chunk of a small class */
+static void *page_alloc(int cls){
+    slab_class *c = &classes[cls];
+    slab_page *pg;
+    char *p;
+    long u;
+
+    P(&c->mutex);
+    if((pg = c->partial) == NULL){
+        if((u = units_alloc(1)) < 0){
+            V(&c->mutex);
+            return NULL;
+        }
+        pg = &units[u].page;
+        pg->free = NULL;
+        pg->carved = 0;
+        pg->cls = cls;
+        pg->used = 0;
+        partial_add(c, pg);
+    }
+    if((p = pg->free) != NULL){
+        pg->free = *(char **)p;
+    }
+    else{
+        p = region + (size_t)((slab_unit *)pg - units) * SLAB_UNIT + pg->carved;
+        pg->carved += c->size;
+    }
+    if(++pg->used == c->per_page){
+        partial_del(c, pg);
+    }
+    V(&c->mutex);
+    return p;
+}
+
+static void page_free(void *p){
+    long u = ((char *)p - region) / SLAB_UNIT;
+    slab_page *pg = &units[u].page;
+    slab_class *c = &classes[pg->cls];
+
+    P(&c->mutex);
+    *(char **)p = pg->free;
+    pg->free = p;
+    if(pg->used-- == c->per_page){
+        partial_add(c, pg);
+    }
+    if(pg->used > 0){
+        V(&c->mutex);
+        return;
+    }
+    // any class may have the unit now
+    partial_del(c, pg);
+    V(&c->mutex);
+    units_free(u, 1);
+}
+
+void *slab_alloc(size_t n){
+    int cls = slab_class_of(n);
+    long u;
+
+    if(cls >= 0){
+        return page_alloc(cls);
+    }
+    if((u = units_alloc((n + SLAB_UNIT - 1) / SLAB_UNIT)) < 0){
+        return NULL;
+    }
+    return region + (size_t)u * SLAB_UNIT;
+}
+
+void slab_free(void *p, size_t n){
+    if(slab_class_of(n) >= 0){
+        page_free(p);
+        return;
+    }
+    units_free(((char *)p - region) / SLAB_UNIT, (n + SLAB_UNIT - 1) / SLAB_UNIT);
+}
+
+size_t slab_charge(size_t n){
+    int cls = slab_class_of(n);
+    size_t unit = SLAB_UNIT + sizeof(slab_unit);
+
+    if(cls >= 0){
+        return unit / classes[cls].per_page;
+    }
+    return (n + SLAB_UNIT - 1) / SLAB_UNIT * unit;
+}
+
+void slab_report(FILE *fp){
+    long used;
+
+    P(&region_mutex);
+    used = units_used;
+    V(&region_mutex);
+    fprintf(fp, "slabs: %ld KB of a %ld KB region in use, %ld KB kept "
+            "beside it\n", used * SLAB_UNIT / 1024,
+            (long)nunits * SLAB_UNIT / 1024,
+            used * (long)sizeof(slab_unit) / 1024);
+}
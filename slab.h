@@ -0,0 +1,28 @@
+/*
+ * slab.h - size class allocator for cached responses
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#define SLAB_UNIT 1024          // what the region is handed out in
+#define SLAB_MIN 64             // smallest chunk
+#define SLAB_GROWTH 125         // percent each small class is of the last
+#define SLAB_RESERVE 4          // bytes of region per byte of cache budget
+
+/* reserve address space for a cache of budget bytes */
+void slab_init(size_t budget);
+/* a chunk of at least n bytes, aligned for any type; NULL if the region
+ * has no room for it
+ */
+void *slab_alloc(size_t n);
+/* give back a chunk slab_alloc(n) returned */
+void slab_free(void *p, size_t n);
+/* what a chunk of n bytes really costs: its share of a unit for a small
+ * class, whole units for a large one, with the same share of what is
+ * kept beside the units
+ */
+size_t slab_charge(size_t n);
+/* print how much of the region is in use */
+void slab_report(FILE *fp);
+
+#endif /* __SLAB_H__ */
@@ -901,33 +901,83 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_getlineb - Return the next text line in the internal buffer
+ *    (buffered). *linep is pointed at the line, '\n' included, and
+ *    its length is returned; the line is not copied and stays valid
+ *    until the next read on rp. A line longer than maxlen (or than
+ *    the internal buffer) comes back in pieces. The buffer is only
+ *    compacted and refilled when a line crosses its end.
  */
-/* $begin rio_readlineb */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+/* $begin rio_getlineb */
+ssize_t rio_getlineb(rio_t *rp, char **linep, size_t maxlen) {
     size_t n;
-    int rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
+    ssize_t rc;
+    char *nl;
+
+    if (maxlen > RIO_BUFSIZE) {
+        maxlen = RIO_BUFSIZE;
+    }
+    while (1) {
+        n = (size_t) rp->rio_cnt < maxlen ? (size_t) rp->rio_cnt : maxlen;
+        if ((nl = memchr(rp->rio_bufptr, '\n', n)) != NULL) {
+            n = nl - rp->rio_bufptr + 1;
+            break;
+        }
+        if (n == maxlen) {
+            break;              /* No newline within maxlen */
+        }
+
+        /* The line runs past the buffered bytes: move them up front */
+        if (rp->rio_bufptr != rp->rio_buf) {
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                  RIO_BUFSIZE - rp->rio_cnt);
+        if (rc < 0) {
+            if (errno != EINTR) {
+                return -1;      /* errno set by read() */
             }
         } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break;    /* EOF, some data was read */
-            }
+            n = rp->rio_cnt;    /* EOF, last line has no newline */
+            break;
         } else {
-            return -1;    /* Error */
+            rp->rio_cnt += rc;
+        }
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+/* $end rio_getlineb */
+
+/*
+ * rio_readlineb - Robustly read a text line (buffered)
+ */
+/* $begin rio_readlineb */
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    size_t n = 0;
+    ssize_t rc;
+    char *line, *bufp = usrbuf;
+
+    /* Copy views of the line until its newline, EOF or maxlen-1 bytes */
+    while (n + 1 < maxlen) {
+        if ((rc = rio_getlineb(rp, &line, maxlen - 1 - n)) < 0) {
+            return -1;          /* Error */
+        } else if (rc == 0) {
+            break;              /* EOF */
         }
+        memcpy(bufp + n, line, rc);
+        n += rc;
+        if (line[rc - 1] == '\n') {
+            break;
+        }
+    }
+    if (maxlen > 0) {
+        bufp[n] = 0;
     }
-    *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
@@ -962,6 +1012,15 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
     return rc;
 }
 
+ssize_t Rio_getlineb(rio_t *rp, char **linep, size_t maxlen) {
+    ssize_t rc;
+
+    if ((rc = rio_getlineb(rp, linep, maxlen)) < 0) {
+        unix_error("Rio_getlineb error");
+    }
+    return rc;
+}
+
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     ssize_t rc;
 
@@ -0,0 +1,224 @@
+/*
+ * upstream.c - pool of idle keep-alive origin connections
+ *
+ * Origins are asked for HTTP/1.1 keep-alive connections. Once a response
+ * has been read to its end the connection is parked here under its
+ * origin (host:port) and the next miss for that origin reuses it instead
+ * of paying for a handshake and a teardown again. A reaper thread closes
+ * connections that have been idle for too long.
+ */
+#include "csapp.h"
+#include "upstream.h"
+
+#define UPSTREAM_BUCKETS 1024
+
+typedef struct origin origin;
+struct origin{
+    char *host;
+    char *port;
+    int nidle;                  // parked connections, most recent last
+    int *idle_fd;
+    time_t *idle_since;
+    origin *next;               // next origin in the bucket
+};
+
+static origin *buckets[UPSTREAM_BUCKETS];
+static sem_t upstream_mutex;    // protects buckets and the origins
+static int max_idle;            // per origin
+static int idle_timeout;        // seconds
+
+static unsigned long hits, misses, stale;
+
+static time_t now_sec(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned origin_hash(char *host, char *port){
+    unsigned h = 2166136261u;
+
+    for(; *host; host++){
+        h = (h ^ (unsigned char)*host) * 16777619u;
+    }
+    h = (h ^ ':') * 16777619u;
+    for(; *port; port++){
+        h = (h ^ (unsigned char)*port) * 16777619u;
+    }
+    return h % UPSTREAM_BUCKETS;
+}
+
+/* look up host:port, adding it if create is set; caller holds the mutex */
+static origin *origin_find(char *host, char *port, int create){
+    unsigned b = origin_hash(host, port);
+    origin *o;
+
+    for(o = buckets[b]; o != NULL; o = o->next){
+        if(strcmp(o->host, host) == 0 && strcmp(o->port, port) == 0){
+            return o;
+        }
+    }
+    if(!create){
+        return NULL;
+    }
+    o = (origin *)Malloc(sizeof(origin));
+    o->host = (char *)Malloc(strlen(host) + 1);
+    strcpy(o->host, host);
+    o->port = (char *)Malloc(strlen(port) + 1);
+    strcpy(o->port, port);
+    o->nidle = 0;
+    o->idle_fd = (int *)Malloc(max_idle * sizeof(int));
+    o->idle_since = (time_t *)Malloc(max_idle * sizeof(time_t));
+    o->next = buckets[b];
+    buckets[b] = o;
+    return o;
+}
+
+static void origin_free(origin *o){
+    Free(o->host);
+    Free(o->port);
+    Free(o->idle_fd);
+    Free(o->idle_since);
+    Free(o);
+}
+
+/* an idle connection should have nothing to read; data or EOF means the
+ * origin has closed it or is about to
+ */
+static int conn_alive(int fd){
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* close connections idle for longer than idle_timeout, dropping origins
+ * that have none left
+ */
+static void *upstream_reaper(void *arg){
+    origin **link, *o;
+    time_t now;
+    int b, i, kept;
+
+    (void)arg;
+    Pthread_detach(pthread_self());
+    while(1){
+        sleep(1);
+        now = now_sec();
+        P(&upstream_mutex);
+        for(b = 0; b < UPSTREAM_BUCKETS; b++){
+            link = &buckets[b];
+            while((o = *link) != NULL){
+                kept = 0;
+                for(i = 0; i < o->nidle; i++){
+                    if(now - o->idle_since[i] >= idle_timeout){
+                        close(o->idle_fd[i]);
+                        continue;
+                    }
+                    o->idle_fd[kept] = o->idle_fd[i];
+                    o->idle_since[kept++] = o->idle_since[i];
+                }
+                o->nidle = kept;
+                if(kept == 0){
+                    *link = o->next;
+                    origin_free(o);
+                }
+                else{
+                    link = &o->next;
+                }
+            }
+        }
+        V(&upstream_mutex);
+    }
+    return NULL;
+}
+
+void upstream_init(int timeout, int max){
+    pthread_t tid;
+
+    Sem_init(&upstream_mutex, 0, 1);
+    idle_timeout = timeout;
+    max_idle = max;
+    if(max_idle > 0){
+        Pthread_create(&tid, NULL, upstream_reaper, NULL);
+    }
+}
+
+int upstream_enabled(void){
+    return max_idle > 0;
+}
+
+int upstream_get(char *host, char *port){
+    origin *o;
+    int fd;
+
+    if(max_idle == 0){
+        return -1;
+    }
+    while(1){
+        P(&upstream_mutex);
+        if((o = origin_find(host, port, 0)) == NULL || o->nidle == 0){
+            V(&upstream_mutex);
+            __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        // take the most recently used one, it is the least likely to
+        // have been timed out by the origin
+        fd = o->idle_fd[--o->nidle];
+        V(&upstream_mutex);
+        if(conn_alive(fd)){
+            __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+            return fd;
+        }
+        close(fd);
+        __atomic_fetch_add(&stale, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void upstream_put(char *host, char *port, int fd){
+    origin *o;
+
+    if(max_idle > 0){
+        P(&upstream_mutex);
+        o = origin_find(host, port, 1);
+        if(o->nidle < max_idle){
+            o->idle_fd[o->nidle] = fd;
+            o->idle_since[o->nidle++] = now_sec();
+            fd = -1;
+        }
+        V(&upstream_mutex);
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+}
+
+void upstream_stale(void){
+    // it was counted as a hit, but the request had to go on a new one
+    __atomic_fetch_add(&stale, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&hits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_report(FILE *fp){
+    unsigned long h = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    unsigned long m = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    unsigned long s = __atomic_load_n(&stale, __ATOMIC_RELAXED);
+    origin *o;
+    int b, idle = 0;
+
+    if(max_idle == 0){
+        return;
+    }
+    P(&upstream_mutex);
+    for(b = 0; b < UPSTREAM_BUCKETS; b++){
+        for(o = buckets[b]; o != NULL; o = o->next){
+            idle += o->nidle;
+        }
+    }
+    V(&upstream_mutex);
+    fprintf(fp, "upstream: %lu reused, %lu new, %lu stale, "
+            "reuse rate %.1f%%, %d idle\n", h, m, s,
+            h + m > 0 ? 100.0 * h / (h + m) : 0.0, idle);
+}
@@ -0,0 +1,25 @@
+/*
+ * upstream.h - pool of idle keep-alive origin connections
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_DEFAULT_IDLE 30        // seconds
+#define UPSTREAM_DEFAULT_MAX_IDLE 8     // per origin
+
+/* keep at most max_idle idle connections per origin and close those
+ * idle for longer than idle_timeout seconds; max_idle 0 disables pooling
+ */
+void upstream_init(int idle_timeout, int max_idle);
+/* whether origin connections are kept open after a response */
+int upstream_enabled(void);
+/* an idle connection to host:port that is still open, or -1 */
+int upstream_get(char *host, char *port);
+/* park fd for the next request to host:port, or close it */
+void upstream_put(char *host, char *port, int fd);
+/* a connection from upstream_get turned out to be closed by the origin */
+void upstream_stale(void);
+/* print reuse statistics */
+void upstream_report(FILE *fp);
+
+#endif /* __UPSTREAM_H__ */
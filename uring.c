@@ -0,0 +1,215 @@
+/*
+ * uring.c - minimal io_uring interface
+ *
+ * Just enough of io_uring for the event loops: set up a ring with the
+ * raw system calls, queue accept/connect/recv/read/send/sendmsg, submit
+ * them in one io_uring_enter and walk the completions.
+ */
+#include "csapp.h"
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+        unsigned min_complete, unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+int uring_init(uring_t *r, unsigned entries, unsigned cq_entries){
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(r, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    if((r->fd = sys_io_uring_setup(entries, &p)) < 0){
+        return -1;
+    }
+    // FAST_POLL (5.7) means send/recv/connect/accept are all there
+    if(!(p.features & IORING_FEAT_FAST_POLL)
+            || !(p.features & IORING_FEAT_NODROP)){
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(r->cq_ring_sz > r->sq_ring_sz){
+            r->sq_ring_sz = r->cq_ring_sz;
+        }
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED){
+        close(r->fd);
+        return -1;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        r->cq_ring = r->sq_ring;
+    }
+    else{
+        r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ring == MAP_FAILED){
+            munmap(r->sq_ring, r->sq_ring_sz);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED){
+        uring_exit(r);
+        return -1;
+    }
+
+    sq = (char *)r->sq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    cq = (char *)r->cq_ring;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(uring_t *r){
+    if(r->sqes != NULL && r->sqes != MAP_FAILED){
+        munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if(r->cq_ring != NULL && r->cq_ring != r->sq_ring){
+        munmap(r->cq_ring, r->cq_ring_sz);
+    }
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+}
+
+/* hand out the next free submission entry, flushing the queue if full */
+static struct io_uring_sqe *uring_get_sqe(uring_t *r){
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+            >= r->sq_entries){
+        uring_submit(r, 0);
+        if(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+                >= r->sq_entries){
+            return NULL;
+        }
+    }
+    idx = r->sqe_tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+static struct io_uring_sqe *uring_prep(uring_t *r, int op, int fd,
+        void *addr, unsigned len, void *data){
+    struct io_uring_sqe *sqe;
+
+    if((sqe = uring_get_sqe(r)) == NULL){
+        return NULL;
+    }
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->user_data = (unsigned long)data;
+    return sqe;
+}
+
+int uring_accept(uring_t *r, int listenfd, void *data){
+    return uring_prep(r, IORING_OP_ACCEPT, listenfd, NULL, 0, data)
+        != NULL ? 0 : -1;
+}
+
+int uring_connect(uring_t *r, int fd, struct sockaddr *addr,
+        socklen_t addrlen, void *data){
+    struct io_uring_sqe *sqe;
+
+    if((sqe = uring_prep(r, IORING_OP_CONNECT, fd, addr, 0, data)) == NULL){
+        return -1;
+    }
+    sqe->off = addrlen;
+    return 0;
+}
+
+int uring_recv(uring_t *r, int fd, void *buf, size_t len, void *data){
+    return uring_prep(r, IORING_OP_RECV, fd, buf, len, data)
+        != NULL ? 0 : -1;
+}
+
+int uring_read(uring_t *r, int fd, void *buf, size_t len, off_t off,
+        void *data){
+    struct io_uring_sqe *sqe;
+
+    if((sqe = uring_prep(r, IORING_OP_READ, fd, buf, len, data)) == NULL){
+        return -1;
+    }
+    sqe->off = off;
+    return 0;
+}
+
+int uring_send(uring_t *r, int fd, void *buf, size_t len, void *data){
+    struct io_uring_sqe *sqe;
+
+    if((sqe = uring_prep(r, IORING_OP_SEND, fd, buf, len, data)) == NULL){
+        return -1;
+    }
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+int uring_sendmsg(uring_t *r, int fd, struct msghdr *msg, void *data){
+    struct io_uring_sqe *sqe;
+
+    if((sqe = uring_prep(r, IORING_OP_SENDMSG, fd, msg, 1, data)) == NULL){
+        return -1;
+    }
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+int uring_submit(uring_t *r, unsigned wait_nr){
+    unsigned to_submit;
+    int rc;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if(to_submit == 0 && wait_nr == 0){
+        return 0;
+    }
+    while((rc = sys_io_uring_enter(r->fd, to_submit, wait_nr,
+                    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0)) < 0
+            && errno == EINTR){
+    }
+    return rc;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *r){
+    unsigned head = *r->cq_head;
+
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r){
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,51 @@
+/*
+ * uring.h - minimal io_uring interface
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;                     // ring descriptor
+    unsigned *sq_head;          // submission queue, shared with the kernel
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // entries handed out, not yet published
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;          // completion queue, shared with the kernel
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;              // mappings, kept for munmap
+    void *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+} uring_t;
+
+/* set up a ring; returns -1 if the kernel can't give us one we can use */
+int uring_init(uring_t *r, unsigned entries, unsigned cq_entries);
+void uring_exit(uring_t *r);
+
+/* queue operations; data comes back as the completion's user_data.
+ * They return -1 if the submission queue is full.
+ */
+int uring_accept(uring_t *r, int listenfd, void *data);
+int uring_connect(uring_t *r, int fd, struct sockaddr *addr,
+        socklen_t addrlen, void *data);
+int uring_recv(uring_t *r, int fd, void *buf, size_t len, void *data);
+/* read from off in a file; 0 for an eventfd or timerfd */
+int uring_read(uring_t *r, int fd, void *buf, size_t len, off_t off,
+        void *data);
+int uring_send(uring_t *r, int fd, void *buf, size_t len, void *data);
+int uring_sendmsg(uring_t *r, int fd, struct msghdr *msg, void *data);
+
+/* submit everything queued and wait for at least wait_nr completions */
+int uring_submit(uring_t *r, unsigned wait_nr);
+/* next completion, or NULL; release it with uring_cqe_seen */
+struct io_uring_cqe *uring_peek_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+
+#endif /* __URING_H__ */